@@ -0,0 +1,284 @@
+/**
+ * @file checksum.h
+ * @brief Checksums shared by the client and server: block checksums for delta
+ * writes and CRC32C for payload integrity.
+ *
+ * The weak checksum is the rsync rolling checksum: it can be slid one byte
+ * forward in constant time, which lets the client look for matching blocks
+ * at every offset of a new buffer. The strong checksum (64-bit FNV-1a) is
+ * only computed to confirm a weak match, and again by the server to check that
+ * a block it copies is still the one the client matched.
+ *
+ * `crc32c()` folds long buffers with carry-less multiplication when the CPU has
+ * it, on 64 byte AVX-512 registers where it can and on 16 byte ones otherwise.
+ * Without it, `crc32c()` uses the SSE4.2 `crc32` instruction, on three
+ * interleaved streams per block so the instruction's latency is hidden, and a
+ * slicing-by-8 table on CPUs without either. The choice and the table are made
+ * once per process, under `pthread_once()`, so threads may checksum
+ * concurrently from the start.
+ */
+#ifndef __CHECKSUM_H__
+#define __CHECKSUM_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static inline uint32_t weak_sum(const unsigned char *p, size_t len) {
+  uint32_t a = 0, b = 0;
+  for (size_t i = 0; i < len; i++) {
+    a += p[i];
+    b += (uint32_t)(len - i) * p[i];
+  }
+  return (a & 0xffff) | (b << 16);
+}
+
+// Slides a weak checksum over `len` bytes one byte forward, dropping `out`
+// and appending `in`.
+static inline uint32_t weak_roll(uint32_t sum, size_t len, unsigned char out,
+                                 unsigned char in) {
+  uint32_t a = sum & 0xffff;
+  uint32_t b = sum >> 16;
+  a = (a - out + in) & 0xffff;
+  b = (b - (uint32_t)len * out + a) & 0xffff;
+  return a | (b << 16);
+}
+
+static inline uint64_t strong_sum(const unsigned char *p, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// The strong checksum of a run of blocks, as a DELTA copy op carries it: the
+// strong sums of its blocks, in order, folded into STRONG_RUN_INIT.
+#define STRONG_RUN_INIT 14695981039346656037ULL
+
+static inline uint64_t strong_run_add(uint64_t run, uint64_t block) {
+  return (run ^ block) * 1099511628211ULL;
+}
+
+#define CRC32C_POLY 0x82f63b78 // reflected Castagnoli polynomial
+#define CRC32C_STREAM 4096     // bytes per stream of an interleaved block
+// x^(8 * CRC32C_STREAM) modulo the polynomial, as crc32c_multmodp() takes it
+#define CRC32C_STREAM_SHIFT 0x35d73a62
+#define CRC32C_FOLD_MIN 256 // shortest buffer the crc32c_fold*() take
+
+// a * b modulo the CRC polynomial, in the reflected bit order of the CRC
+static inline uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+  uint32_t m = (uint32_t)1 << 31, p = 0;
+  while (m) {
+    if (a & m)
+      p ^= b;
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+// How crc32c() computes, chosen once per process by crc32c_init().
+enum { CRC32C_SW, CRC32C_HW, CRC32C_CLMUL, CRC32C_FOLD };
+static int crc32c_impl;
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static inline void crc32c_init() {
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t c = n;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    crc32c_table[0][n] = c;
+  }
+  for (int t = 1; t < 8; t++)
+    for (int n = 0; n < 256; n++)
+      crc32c_table[t][n] = (crc32c_table[t - 1][n] >> 8) ^
+                           crc32c_table[0][crc32c_table[t - 1][n] & 0xff];
+
+  crc32c_impl = CRC32C_SW;
+#if defined(__x86_64__)
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_2))
+    return;
+  crc32c_impl = ecx & bit_PCLMUL ? CRC32C_CLMUL : CRC32C_HW;
+  // the wide fold needs AVX-512 with carry-less multiplication, and the OS
+  // saving the AVX-512 registers
+  if (crc32c_impl != CRC32C_CLMUL || !(ecx & bit_OSXSAVE))
+    return;
+  unsigned xcr0, xcr0_hi;
+  __asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0_hi) : "c"(0));
+  if ((xcr0 & 0xe6) == 0xe6 &&
+      __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX512F) &&
+      (ebx & bit_AVX512VL) && (ecx & bit_VPCLMULQDQ))
+    crc32c_impl = CRC32C_FOLD;
+#endif
+}
+
+static inline uint32_t crc32c_sw(uint32_t crc, const unsigned char *p,
+                                 size_t len) {
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    w ^= crc; // little-endian, like the wire format
+    crc = crc32c_table[7][w & 0xff] ^ crc32c_table[6][(w >> 8) & 0xff] ^
+          crc32c_table[5][(w >> 16) & 0xff] ^
+          crc32c_table[4][(w >> 24) & 0xff] ^
+          crc32c_table[3][(w >> 32) & 0xff] ^
+          crc32c_table[2][(w >> 40) & 0xff] ^
+          crc32c_table[1][(w >> 48) & 0xff] ^ crc32c_table[0][w >> 56];
+  }
+  while (len--)
+    crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+  return crc;
+}
+
+#if defined(__x86_64__)
+// optimized even in unoptimized builds: the payload path runs through it
+__attribute__((target("sse4.2"), optimize("O2"))) static inline uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+  // three independent streams keep the crc32 unit busy; their registers are
+  // combined by shifting the earlier ones over the data that follows them
+  for (; len >= 3 * CRC32C_STREAM;
+       p += 3 * CRC32C_STREAM, len -= 3 * CRC32C_STREAM) {
+    uint64_t c0 = crc, c1 = 0, c2 = 0, w0, w1, w2;
+    for (size_t i = 0; i < CRC32C_STREAM; i += 8) {
+      memcpy(&w0, p + i, 8);
+      memcpy(&w1, p + CRC32C_STREAM + i, 8);
+      memcpy(&w2, p + 2 * CRC32C_STREAM + i, 8);
+      c0 = _mm_crc32_u64(c0, w0);
+      c1 = _mm_crc32_u64(c1, w1);
+      c2 = _mm_crc32_u64(c2, w2);
+    }
+    crc = crc32c_multmodp(CRC32C_STREAM_SHIFT,
+                          crc32c_multmodp(CRC32C_STREAM_SHIFT, c0) ^ c1) ^
+          c2;
+  }
+  uint64_t c = crc, w;
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&w, p, 8);
+    c = _mm_crc32_u64(c, w);
+  }
+  crc = c;
+  while (len--)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+
+// Moves the 128-bit `x` `d` bytes forward in the message, using the constant
+// pair x^(8d + 31), x^(8d - 33) modulo the polynomial, and adds it to `y`.
+#define CRC32C_CLMUL_STEP(x, k, y)                                             \
+  _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),                \
+                              _mm_clmulepi64_si128(x, k, 0x11)),               \
+                y)
+
+// crc32c_fold() for CPUs with PCLMULQDQ but not AVX-512: the same folding on
+// 16 byte registers, 64 bytes at a time, with the same contract.
+__attribute__((target("pclmul,sse4.2"), optimize("O2"))) static inline uint32_t
+crc32c_fold_clmul(uint32_t crc, const unsigned char *p, size_t len,
+                  size_t *used) {
+  const __m128i k64 = _mm_set_epi64x(0x9e4addf8, 0x740eef02);
+  const __m128i k48 = _mm_set_epi64x(0xddc0152b, 0x1c291d04);
+  const __m128i k32 = _mm_set_epi64x(0xba4fc28e, 0x3da6d0cb);
+  const __m128i k16 = _mm_set_epi64x(0x493c7d27, 0xf20c0dfe);
+  const unsigned char *start = p;
+
+  __m128i x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)p),
+                             _mm_cvtsi32_si128(crc));
+  __m128i x1 = _mm_loadu_si128((const __m128i *)(p + 16));
+  __m128i x2 = _mm_loadu_si128((const __m128i *)(p + 32));
+  __m128i x3 = _mm_loadu_si128((const __m128i *)(p + 48));
+  for (p += 64, len -= 64; len >= 64; p += 64, len -= 64) {
+    x0 = CRC32C_CLMUL_STEP(x0, k64, _mm_loadu_si128((const __m128i *)p));
+    x1 = CRC32C_CLMUL_STEP(x1, k64, _mm_loadu_si128((const __m128i *)(p + 16)));
+    x2 = CRC32C_CLMUL_STEP(x2, k64, _mm_loadu_si128((const __m128i *)(p + 32)));
+    x3 = CRC32C_CLMUL_STEP(x3, k64, _mm_loadu_si128((const __m128i *)(p + 48)));
+  }
+  __m128i r = CRC32C_CLMUL_STEP(
+      x0, k48, CRC32C_CLMUL_STEP(x1, k32, CRC32C_CLMUL_STEP(x2, k16, x3)));
+
+  *used = p - start;
+  uint64_t c = _mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(r));
+  return _mm_crc32_u64(c, (uint64_t)_mm_extract_epi64(r, 1));
+}
+
+// Moves the 128-bit pieces of `x` `d` bytes forward in the message, as
+// CRC32C_CLMUL_STEP() does, and adds them to `y`.
+#define CRC32C_FOLD_STEP(x, k, y)                                              \
+  _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x, k, 0x00),              \
+                            _mm512_clmulepi64_epi128(x, k, 0x11), y, 0x96)
+
+// Folds the buffer, 256 bytes at a time, into a 16 byte remainder with the
+// same CRC with carry-less multiplications, which run at several times the
+// rate of the crc32 instruction; that instruction then finishes it. `len` is
+// at least CRC32C_FOLD_MIN; the bytes after the last whole 256 are left to
+// crc32c_hw(), and *used says how many were consumed.
+__attribute__((target("avx512f,avx512vl,vpclmulqdq,sse4.2"), optimize("O2")))
+static inline uint32_t
+crc32c_fold(uint32_t crc, const unsigned char *p, size_t len, size_t *used) {
+  const __m512i k256 = _mm512_broadcast_i32x4(
+      _mm_set_epi64x(0xb9e02b86, 0xdcb17aa4)); // d = 256
+  const __m512i k64 = _mm512_broadcast_i32x4(
+      _mm_set_epi64x(0x9e4addf8, 0x740eef02)); // d = 64
+  // the four 16 byte lanes of a register are 48, 32 and 16 bytes before the
+  // last one, which stays where it is
+  const __m512i klanes = _mm512_set_epi64(0, 0, 0x493c7d27, 0xf20c0dfe,
+                                          0xba4fc28e, 0x3da6d0cb,
+                                          0xddc0152b, 0x1c291d04);
+  const unsigned char *start = p;
+
+  // the CRC register so far is added to the first four bytes
+  __m512i x0 = _mm512_xor_si512(_mm512_loadu_si512(p),
+                                _mm512_castsi128_si512(_mm_cvtsi32_si128(crc)));
+  __m512i x1 = _mm512_loadu_si512(p + 64);
+  __m512i x2 = _mm512_loadu_si512(p + 128);
+  __m512i x3 = _mm512_loadu_si512(p + 192);
+  for (p += 256, len -= 256; len >= 256; p += 256, len -= 256) {
+    x0 = CRC32C_FOLD_STEP(x0, k256, _mm512_loadu_si512(p));
+    x1 = CRC32C_FOLD_STEP(x1, k256, _mm512_loadu_si512(p + 64));
+    x2 = CRC32C_FOLD_STEP(x2, k256, _mm512_loadu_si512(p + 128));
+    x3 = CRC32C_FOLD_STEP(x3, k256, _mm512_loadu_si512(p + 192));
+  }
+  x1 = CRC32C_FOLD_STEP(x0, k64, x1);
+  x2 = CRC32C_FOLD_STEP(x1, k64, x2);
+  x3 = CRC32C_FOLD_STEP(x2, k64, x3);
+  __m512i z = CRC32C_FOLD_STEP(x3, klanes, _mm512_setzero_si512());
+  __m128i r = _mm_xor_si128(
+      _mm_xor_si128(_mm512_extracti32x4_epi32(z, 0),
+                    _mm512_extracti32x4_epi32(z, 1)),
+      _mm_xor_si128(_mm512_extracti32x4_epi32(z, 2),
+                    _mm512_extracti32x4_epi32(x3, 3)));
+
+  *used = p - start;
+  uint64_t c = _mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(r));
+  return _mm_crc32_u64(c, (uint64_t)_mm_extract_epi64(r, 1));
+}
+#endif
+
+// CRC32C of `len` bytes continuing from `crc`, 0 for a new checksum.
+static inline uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+  const unsigned char *p = buf;
+  crc = ~crc;
+  pthread_once(&crc32c_once, crc32c_init);
+#if defined(__x86_64__)
+  if (crc32c_impl >= CRC32C_CLMUL && len >= CRC32C_FOLD_MIN) {
+    size_t used;
+    crc = crc32c_impl == CRC32C_FOLD ? crc32c_fold(crc, p, len, &used)
+                                     : crc32c_fold_clmul(crc, p, len, &used);
+    p += used;
+    len -= used;
+  }
+  if (crc32c_impl != CRC32C_SW)
+    return ~crc32c_hw(crc, p, len);
+#endif
+  return ~crc32c_sw(crc, p, len);
+}
+
+#endif
@@ -5,7 +5,10 @@
  * This file contains the request and response message formats used in an
  * RPC protocol for remote file operations over TCP. The protocol supports
  * standard file operations such as open, read, write, close, seek, stat,
- * unlink, and directory traversal.
+ * unlink, and directory traversal. Large rewrites can be sent as a delta
+ * against the current file content (`CHECKSUMS` followed by `DELTA`), and
+ * `READDIRPLUS` returns a page of directory entries with their attributes.
+ * `PREAD` reads at an explicit offset so ranges can be fetched in parallel.
  *
  * Structures:
  * - `request`: Encapsulates a request header and the corresponding payload.
@@ -16,9 +19,13 @@
  * - `response_header`: Common response header with error handling.
  * - `res_union`: Union of different response types.
  *
- * Each request and response structure ensures proper serialization and
- * deserialization for efficient communication between client and server.
+ * These are the in-memory forms of the messages. On the wire each opcode only
+ * carries its own fields, encoded as described in `wire.h`.
  */
+#ifndef __MESSAGE_H__
+#define __MESSAGE_H__
+
+#include <stdint.h>
 #include <sys/types.h>
 
 enum OPCODE {
@@ -32,8 +39,25 @@ enum OPCODE {
   GETDIRENTRIES,
   GETDIRTREE,
   FREEDIRTREE,
+  CHECKSUMS,
+  DELTA,
+  READDIRPLUS, // takes a direntries_req
+  PREAD,       // answered with a read_res
+  COPY,        // server-side copy of one file to another path
+  RMTREE,      // server-side recursive remove; takes a dirtree_req
+  OPTIONS,     // negotiates connection features, see options_req
+  ATTACH,      // makes a new connection a channel of a session
+  LEASE,       // stats a path and asks for a lease on it, see lease_req
+  RECALL,      // sent by the server on a callback channel, see recall_res
+  RELEASE,     // gives a lease back; not answered
 };
 
+// req_header.flags for OPEN: the client may send DELTA writes on this fd, so
+// the server opens it readable when it can. If it truncates the file, it
+// keeps a reflink snapshot of the old content to copy blocks from, where the
+// filesystem supports that.
+#define REQ_OPEN_DELTA 1
+
 typedef struct {
   int version;
   enum OPCODE opcode;
@@ -53,6 +77,12 @@ typedef struct {
   size_t nbyte;
 } read_req;
 
+typedef struct {
+  int fd;
+  size_t nbyte;
+  off_t offset;
+} pread_req;
+
 typedef struct {
   int fd;
   size_t count;
@@ -86,9 +116,82 @@ typedef struct {
   char path[0];
 } dirtree_req;
 
+typedef struct {
+  int fd;
+  size_t len;        // length of the write about to be sent
+  size_t block_size;
+} checksums_req;
+
+typedef struct {
+  off_t src;  // COPY: offset of the source bytes in the file, -1 for LITERAL
+  size_t len; // bytes this op contributes to the new data
+  // COPY: strong sum of the source blocks (strong_run_add()), which the
+  // server checks before it copies them
+  uint64_t strong;
+} delta_op;
+
+typedef struct {
+  int fd;
+  size_t nops;
+  size_t literal_len;
+  size_t block_size; // of the CHECKSUMS the copy ops were matched against
+  char buf[0];       // delta_op[nops] followed by literal_len literal bytes
+} delta_req;
+
+typedef struct {
+  size_t src_len; // bytes of the source path, including its NUL
+  char paths[0];  // source path, then destination path, both NUL-terminated
+} copy_req;
+
+// options_req.features: READ/PREAD data in responses, and WRITE data and
+// DELTA ops and literals in requests, are followed by their CRC32C
+// (checksum.h), counted in payload_len.
+#define FEAT_CRC32C 1
+// options_req.features: the client wants a metadata channel. The server
+// answers with a token; a second connection that sends it in ATTACH joins
+// the session, and the server serves it ahead of the first one.
+#define FEAT_META_CHANNEL 2
+// options_req.features: READ/PREAD responses may leave out holes of sparse
+// files and describe them with read_hole entries instead, see read_res.
+#define FEAT_SPARSE 4
+// options_req.features: the client wants leases. The server answers with a
+// lease_token; a second connection that sends it in ATTACH becomes the
+// session's callback channel, where the server sends RECALLs of the
+// session's leases and the client answers each with a RELEASE.
+#define FEAT_LEASES 8
+
+// Lease modes. Read leases on a path can be held by any number of sessions;
+// a write delegation excludes leases of all other sessions.
+#define LEASE_READ 1
+#define LEASE_WRITE 2
+
+// Asks for a set of features on this connection; the server answers with the
+// subset it enables, which applies to the requests sent after it. `client`
+// names the client process the connection belongs to: the server schedules
+// all connections with the same nonzero id as one client, so shard and stripe
+// connections don't add to a client's share.
+typedef struct {
+  uint32_t features;
+  uint64_t client;
+} options_req;
+
+typedef struct {
+  uint64_t token; // from options_res; answered with a close_res
+} attach_req;
+
+typedef struct {
+  uint32_t mode; // LEASE_READ or LEASE_WRITE
+  char pathname[0];
+} lease_req;
+
+typedef struct {
+  uint64_t lease; // from lease_res or recall_res
+} release_req;
+
 union req_union {
   open_req open;
   read_req read;
+  pread_req pread;
   write_req write;
   close_req close;
   lseek_req lseek;
@@ -96,6 +199,13 @@ union req_union {
   unlink_req unlink;
   direntries_req direntries;
   dirtree_req dirtree;
+  checksums_req checksums;
+  delta_req delta;
+  copy_req copy;
+  options_req options;
+  attach_req attach;
+  lease_req lease;
+  release_req release;
 };
 
 typedef struct {
@@ -111,8 +221,19 @@ typedef struct {
   ssize_t ret_val;
 } write_res;
 
+// A run of `len` zero bytes `off` bytes into the data of a read_res
 typedef struct {
-  size_t nbyte;
+  uint64_t off;
+  uint64_t len;
+} read_hole;
+
+#define SPARSE_MAX_HOLES 16 // per read_res
+
+typedef struct {
+  ssize_t nbyte;
+  uint32_t nholes; // at most SPARSE_MAX_HOLES, 0 without FEAT_SPARSE
+  // nbyte bytes of data, sent right after these fields; the holes, in order,
+  // are left out of it and sent as read_hole[nholes] after it
   char buf[0];
 } read_res;
 
@@ -133,8 +254,18 @@ typedef struct {
   int ret_val;
 } unlink_res;
 
+// A directory entry in GETDIRENTRIES and READDIRPLUS responses, followed by
+// name_len bytes of its name (no NUL). The client rebuilds struct dirent
+// records from it.
 typedef struct {
-  ssize_t ret_val;
+  uint64_t ino;
+  uint64_t off;  // directory offset of the entry after it
+  uint8_t type;  // DT_*
+  uint16_t name_len;
+} dirent_rec;
+
+typedef struct {
+  ssize_t ret_val; // bytes of dirent_rec entries, or -1
   off_t basep;
   char buf[0];
 } direntries_res;
@@ -143,6 +274,66 @@ typedef struct {
   char buf[0];
 } dirtree_res;
 
+typedef struct {
+  uint32_t weak;
+  uint64_t strong;
+} block_sum;
+
+// Checksums of the full blocks of [start, start + nblocks * block_size),
+// a window around the current offset `pos` sized from checksums_req.len.
+typedef struct {
+  int ret_val;
+  off_t pos;
+  off_t size;
+  off_t start;
+  size_t nblocks;
+  block_sum sums[0];
+} checksums_res;
+
+typedef struct {
+  int ret_val;
+  struct stat statbuf;
+} entry_attr;
+
+typedef struct {
+  ssize_t ret_val; // bytes of dirent_rec entries, or -1
+  off_t basep;
+  size_t nattrs;
+  char buf[0]; // ret_val bytes of dirent_rec entries, then entry_attr[nattrs]
+} readdirplus_res;
+
+typedef struct {
+  off_t nbyte; // bytes copied, or -1
+} copy_res;
+
+typedef struct {
+  ssize_t nremoved; // files and directories removed, or -1 if any failed
+} rmtree_res;
+
+typedef struct {
+  uint32_t features;
+  uint64_t token; // FEAT_META_CHANNEL: what the metadata channel attaches with
+  uint64_t lease_token; // FEAT_LEASES: what the callback channel attaches with
+} options_res;
+
+// Attributes of a path, valid together with everything else derived from the
+// path (its data, or its absence) until `term_ms` after the request was sent
+// or until the lease is recalled. With ret_val -1 and ENOENT, the lease is on
+// the nearest existing ancestor directory, whose entries it covers. `lease`
+// is 0 if none was granted; `mode` may differ from what was asked for: weaker
+// for directories, or stronger when it renews a write delegation.
+typedef struct {
+  int ret_val;
+  struct stat statbuf;
+  uint64_t lease;
+  uint32_t mode;
+  uint32_t term_ms;
+} lease_res;
+
+typedef struct {
+  uint64_t lease; // stop using it, then RELEASE it
+} recall_res;
+
 union res_union {
   open_res open;
   read_res read;
@@ -153,6 +344,13 @@ union res_union {
   unlink_res unlink;
   direntries_res direntries;
   dirtree_res dirtree;
+  checksums_res checksums;
+  readdirplus_res readdirplus;
+  copy_res copy;
+  rmtree_res rmtree;
+  options_res options;
+  lease_res lease;
+  recall_res recall;
 };
 
 typedef struct {
@@ -164,3 +362,5 @@ typedef struct {
   response_header header;
   union res_union res;
 } response;
+
+#endif
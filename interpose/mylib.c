@@ -10,26 +10,78 @@
  *
  * Features:
  * - **RPC Communication**: Uses `makerpc()` to send requests and receive
- * responses.
- * - **Remote File Descriptors**: Tracks remote file descriptors using
- * `open_fds[]`.
- * - **Client Initialization**: Connects to the file server based on environment
- * variables.
+ * responses. Requests and responses are described by `iovec` arrays so user
+ * buffers go out with `sendmsg()` and READ data lands directly in the caller's
+ * buffer via `recvmsg()`, without intermediate copies. Only the header and
+ * fixed fields are encoded (`wire.h`) on the way.
+ * - **Remote File Descriptors**: Tracks remote file descriptors, the path
+ * they were opened with and any buffered directory page in `open_fds[]`.
+ * - **Client Initialization**: Connects to the file servers based on
+ * environment variables, on the first remote operation rather than at load.
+ * - **Mount Routing**: With remote mount prefixes configured (`mounts15440`
+ * or the file named by `mountfile15440`), only paths under them go to the
+ * servers; everything else, like `/proc` or the loader's files, is passed to
+ * the original libc functions.
+ * - **Sharding**: With several servers configured, path-based operations go
+ * to the shard chosen by consistent hashing of the parent directory
+ * (`shard_for()`), so all entries of a directory live on one server, which
+ * lists them (`follow_dir_shard()`); `getdirtree()` merges the trees of all
+ * shards. Each remote fd remembers the shard and server fd it was opened on.
+ * The protocol cannot create directories, so the directory tree is made on
+ * every server beforehand (e.g. the same `mkdir -p` on each); files are
+ * created, found and removed on their shard only.
+ * - **Striped Reads**: With stripe connections configured, large reads of
+ * read-only files are split into ranges fetched with `PREAD` over all of
+ * them in parallel and received in place into the caller's buffer.
  * - **Function Interposition**: Overrides system calls via `dlsym(RTLD_NEXT)`.
  * - **Directory Tree Handling**: Supports `getdirtree()` and `freedirtree()`.
+ * - **Batched Listing**: `getdirentries()` fetches large pages with
+ * `READDIRPLUS` and prefills a short-lived attribute cache, so `stat()` calls
+ * on the listed entries are answered locally. The same cache remembers
+ * `ENOENT` results of `open()`/`stat()` for a shorter time, so repeated
+ * lookups of missing files (search paths) don't reach the server.
+ * - **Delta Writes**: Large writes to a file opened for writing fetch block
+ * checksums of the data around the file offset and send only changed bytes
+ * plus copy instructions (`delta_write()`). If a copied block changed since,
+ * the server refuses the delta and the data is sent with a plain WRITE.
+ * - **Payload Checksums**: With `crc15440=1`, every connection asks the
+ * server for CRC32C checksums of file data (`OPTIONS`). READ data is
+ * checksummed as it is received and a mismatch fails the read with `EIO`;
+ * WRITE and DELTA data is checksummed right before it is sent (`rpc_send()`)
+ * for the server to verify, and a DELTA it rejects is retried as a WRITE.
+ * - **Metadata Channel**: With `metachannel15440=1`, a second connection to
+ * every shard carries OPEN, STAT, UNLINK, CLOSE and LSEEK, which the server
+ * serves ahead of bulk requests, so they don't wait behind large transfers
+ * on the first one (`shard_sock()`).
+ * - **Sparse Reads**: Unless `sparse15440=0`, connections ask the server to
+ * leave holes of sparse files out of READ/PREAD data (`FEAT_SPARSE`); the
+ * hole list that comes instead is expanded into the caller's buffer
+ * (`expand_holes()`), so only allocated data crosses the network.
+ * - **Leases**: With `leases15440=1`, `stat()` and `open()` ask the server for
+ * a lease along with the attributes, and the attribute cache (including
+ * `ENOENT` results) trusts an entry exactly as long as its lease. Small files
+ * read from the start are kept in the entry, so later read-only opens of them
+ * are served locally until the server recalls the lease over the callback
+ * channel. Writers get a write delegation and keep the cached copy current.
+ * Changes made to the exported files by anything but the server are not
+ * seen.
+ * - **Tracing**: With `trace15440` set, every call that goes to a server is
+ * recorded with its arguments, result and timing to `<trace15440>.<pid>`
+ * (format in `trace.h`), for replay against a server with `replay`.
  *
  * The `_init()` function initializes the library, setting up function pointers
- * and establishing a connection to the remote server. The implementation
- * ensures compatibility with standard file operations while providing seamless
- * remote access.
+ * and the mount table. The implementation ensures compatibility with standard
+ * file operations while providing seamless remote access.
  */
 #define _GNU_SOURCE
 
+#include <dirent.h>
 #include <dlfcn.h>
 #include <stdio.h>
 
 #include <fcntl.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -38,13 +90,21 @@
 #include <arpa/inet.h>
 #include <err.h>
 #include <errno.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <sys/socket.h>
+#include <time.h>
+#include <sys/uio.h>
 
 #include "../include/dirtree.h"
+#include "checksum.h"
 #include "message.h"
+#include "trace.h"
+#include "wire.h"
 
 #define MAXMSGLEN 1048575
 #define BUFLEN 2048
@@ -52,12 +112,148 @@
 #define INT_SIZE sizeof(int)
 #define REMOTE_FD 32768
 #define MAXIMUM_FD 65536
-
-int sockfd;
-int open_fds[MAXIMUM_FD] = {0};
+#define RPC_MAXIOV 8
+#define DELTA_BLOCK 4096
+#define DELTA_MIN_WRITE (16 * DELTA_BLOCK)
+
+#define DIR_PAGE_BYTES 65536
+#define ATTR_CACHE_BUCKETS 4096
+#define ATTR_CACHE_MAX 65536
+#define ATTR_CACHE_TTL_NS 2000000000L
+#define NEG_CACHE_TTL_NS 1000000000L
+#define DIR_GEN_SLOTS 1024
+#define MAX_SHARDS 16
+#define SHARD_VNODES 64
+#define MAX_STRIPES 16
+#define STRIPE_MIN_READ (128 * 1024)
+#define MAX_MOUNTS 64
+#define LEASE_DATA_MAX (256 * 1024)         // per file
+#define LEASE_DATA_TOTAL (64L * 1024 * 1024) // for all files
+#define RECALLED_IDS 64
+
+// remote_file flags
+#define FD_OPEN 1
+#define FD_DELTA 2   // large writes may be sent as DELTA
+#define FD_RDONLY 4  // large reads may be striped
+#define FD_STRIPED 8 // also open on the stripe connections, see remote_file
+#define FD_LOCAL 16  // read from the data cached in `entry`; sfd is -1
+#define FD_APPEND 32
+
+// A connection to a file server. The first nshards are the shards paths are
+// spread over by consistent hashing; the nstripes after them are the extra
+// connections striped reads use, to replicas or to the same servers.
+struct shard {
+  struct sockaddr_in addr;
+  int sockfd;
+  int crc;     // FEAT_CRC32C was negotiated on the connection
+  int msockfd; // metadata channel of a shard, or -1
+  int csockfd; // callback channel of a shard with leases, or -1
+  // a RECALL partly received on csockfd
+  unsigned char recall[WIRE_HEADER_SIZE + WIRE_SIZE_recall_res];
+  size_t recall_len;
+};
+
+struct shard shards[MAX_SHARDS + MAX_STRIPES];
+int nshards = 0;
+int nstripes = 0;
+
+// SHARD_VNODES points per shard on the hash ring, sorted by hash
+struct ring_point {
+  uint64_t hash;
+  int shard;
+};
+
+struct ring_point ring[MAX_SHARDS * SHARD_VNODES];
+int nring = 0;
+
+// A page of directory entries fetched with READDIRPLUS; getdirentries()
+// hands out its records until it is used up.
+struct dir_page {
+  size_t len;  // bytes of dirent records
+  size_t next; // offset of the next record to return
+  off_t pos;   // directory offset of the next record
+  char *entries;
+};
+
+// Remote fds handed to the program are REMOTE_FD plus an index into
+// open_fds[], which maps to the server fd on its shard.
+struct remote_file {
+  int flags;
+  int shard;
+  int sfd;
+  char *path;
+  struct dir_page *dir;
+  // FD_STRIPED: all reads are positional, so the client keeps the offset,
+  // and stripe_sfd[i] is the file's fd on shards[nshards + i] (or -1)
+  off_t pos;
+  int *stripe_sfd;
+  // With a lease on the file, `entry` is its cache entry, referenced by the
+  // fd. Reads and writes keep `pos`; reads from offset 0 on collect the
+  // content in `fill` until it can be cached in the entry.
+  struct attr_entry *entry;
+  char *fill;
+  size_t fill_len;
+};
+
+struct remote_file open_fds[MAXIMUM_FD] = {0};
+int free_hint = 0; // no free open_fds[] slot below this index
+
+// Attribute cache keyed by path, filled from READDIRPLUS results and from
+// lookups that failed with ENOENT. A negative entry is only valid while the
+// generation of its parent directory is unchanged.
+//
+// With leases, entries come from LEASE instead and are valid while their
+// lease is: until it expires or the server recalls it. They may then also
+// hold the file's content.
+struct attr_entry {
+  struct attr_entry *next;
+  long expires;
+  int err;        // 0, or ENOENT for a negative entry
+  unsigned gen;   // dir_gens[] slot value of the parent when cached
+  int refs;       // one while in the cache, plus one per fd using it
+  int stale;      // own writes under the lease changed the attributes
+  uint64_t lease; // 0 once the lease is recalled
+  int mode;       // LEASE_READ or LEASE_WRITE
+  char *data;     // statbuf.st_size bytes, or NULL
+  struct stat statbuf;
+  char path[];
+};
+
+struct attr_entry *attr_cache[ATTR_CACHE_BUCKETS];
+int attr_cache_count = 0;
+long lease_data_bytes = 0; // held in attr_entry.data
+
+int leases_on = 0; // every shard has a callback channel
+// The last leases recalled, which a LEASE response received after the
+// recall may still carry.
+uint64_t recalled[RECALLED_IDS];
+int recalled_next = 0;
+int attach_sock = -1; // connection ATTACH is sent on
+
+// Bumped whenever we create something in a directory that hashes to the slot;
+// collisions only cost extra negative cache misses.
+unsigned dir_gens[DIR_GEN_SLOTS];
+
+// A remote mount prefix, without trailing '/'. Mounts are bucketed by the
+// first character of their first component, so most local paths are ruled
+// out with one table lookup.
+struct mount {
+  struct mount *next;
+  size_t len;
+  char prefix[];
+};
+
+struct mount *mounts[256];
+int nmounts = 0;    // no mounts configured: every path is remote
+int mount_root = 0; // "/" is mounted: every absolute path is remote
+int mount_cwd = 0;  // "." is mounted: every relative path is remote
+int client_ready = 0;
 
 // client
-void makerpc(request *h, response *r);
+void initialize_client();
+void makerpc(int shard, const struct iovec *req_iov, int req_cnt,
+             const struct iovec *res_iov, int res_cnt);
+static void negotiate_features(uint32_t features);
 
 int remote_fd(int fd) {
   if (fd >= REMOTE_FD) {
@@ -66,71 +262,750 @@ int remote_fd(int fd) {
       fprintf(stderr, "please consider to add MAXIMUM_FD\n");
       exit(1);
     }
-    if (open_fds[real_fd])
+    if (open_fds[real_fd].flags)
       return 1;
   }
   return 0;
 }
 
+static long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static unsigned long path_hash(const char *path, size_t len) {
+  unsigned long h = 5381;
+  for (size_t i = 0; i < len; i++)
+    h = h * 33 + (unsigned char)path[i];
+  return h;
+}
+
+static unsigned *dir_gen(const char *path) {
+  const char *slash = strrchr(path, '/');
+  size_t len = slash ? (size_t)(slash - path) : 0;
+  return &dir_gens[path_hash(path, len) % DIR_GEN_SLOTS];
+}
+
+static struct attr_entry **attr_cache_find(const char *path) {
+  struct attr_entry **e =
+      &attr_cache[path_hash(path, strlen(path)) % ATTR_CACHE_BUCKETS];
+  while (*e && strcmp((*e)->path, path) != 0)
+    e = &(*e)->next;
+  return e;
+}
+
+static void attr_entry_drop_data(struct attr_entry *e) {
+  if (e->data) {
+    lease_data_bytes -= e->statbuf.st_size;
+    free(e->data);
+    e->data = NULL;
+  }
+}
+
+static void attr_entry_unref(struct attr_entry *e) {
+  if (--e->refs > 0)
+    return;
+  attr_entry_drop_data(e);
+  free(e);
+}
+
+// Unlinks the entry at `link`. With `invalidate`, fds using it stop trusting
+// it too.
+static void attr_cache_unlink(struct attr_entry **link, int invalidate) {
+  struct attr_entry *e = *link;
+  *link = e->next;
+  attr_cache_count--;
+  if (invalidate)
+    e->lease = 0;
+  attr_entry_unref(e);
+}
+
+static void attr_cache_clear() {
+  for (int i = 0; i < ATTR_CACHE_BUCKETS; i++)
+    while (attr_cache[i])
+      attr_cache_unlink(&attr_cache[i], 0);
+}
+
+// Returns a fresh entry for `path`, replacing any cached one, unless that
+// one is under `lease`, in which case it is returned to be updated in place.
+static struct attr_entry *attr_cache_insert(const char *path, uint64_t lease) {
+  struct attr_entry **link = attr_cache_find(path);
+  if (*link && lease && (*link)->lease == lease)
+    return *link;
+  if (*link)
+    attr_cache_unlink(link, 1);
+  else if (attr_cache_count >= ATTR_CACHE_MAX) {
+    attr_cache_clear();
+    link = attr_cache_find(path);
+  }
+  size_t len = strlen(path) + 1;
+  *link = calloc(1, sizeof(struct attr_entry) + len);
+  (*link)->refs = 1;
+  memcpy((*link)->path, path, len);
+  attr_cache_count++;
+  return *link;
+}
+
+// Whether `e` is still covered by its lease.
+static int lease_valid(const struct attr_entry *e) {
+  return e->lease && e->expires > now_ns();
+}
+
+// Attributes prefetched by listings keep their short expiry even with leases;
+// granting a lease for every entry listed would cost more than it saves.
+static void attr_cache_put(const char *path, const struct stat *statbuf) {
+  struct attr_entry *old = *attr_cache_find(path);
+  if (old && lease_valid(old))
+    return;
+  struct attr_entry *e = attr_cache_insert(path, 0);
+  e->statbuf = *statbuf;
+  e->expires = now_ns() + ATTR_CACHE_TTL_NS;
+}
+
+// With leases, ENOENT results are cached under a lease on the directory.
+static void neg_cache_put(const char *path) {
+  if (leases_on)
+    return;
+  struct attr_entry *e = attr_cache_insert(path, 0);
+  e->err = ENOENT;
+  e->gen = *dir_gen(path);
+  e->expires = now_ns() + NEG_CACHE_TTL_NS;
+}
+
+static void attr_cache_drop(const char *path) {
+  if (path == NULL || attr_cache_count == 0)
+    return;
+  struct attr_entry **link = attr_cache_find(path);
+  if (*link)
+    attr_cache_unlink(link, 1);
+}
+
+static void leases_poll();
+
+// Returns the valid cache entry of `path`, or NULL. Negative entries are
+// only returned while the parent's generation matches.
+static struct attr_entry *attr_cache_lookup(const char *path) {
+  if (attr_cache_count == 0)
+    return NULL;
+  if (leases_on)
+    leases_poll();
+  struct attr_entry **link = attr_cache_find(path);
+  struct attr_entry *e = *link;
+  if (e == NULL)
+    return NULL;
+  int stale = e->lease ? !lease_valid(e)
+                       : e->expires < now_ns() ||
+                             (e->err && e->gen != *dir_gen(path));
+  if (stale) {
+    // an expired lease may be renewed with the same id; its data stays
+    // valid then, so the entry is kept for lease_stat() to find
+    if (!e->lease || e->expires < now_ns() - ATTR_CACHE_TTL_NS)
+      attr_cache_unlink(link, 0);
+    return NULL;
+  }
+  return e;
+}
+
+// Returns 0 and fills `statbuf` if `path` has valid cached attributes,
+// ENOENT if it is cached as missing, and -1 if it is not cached.
+static int attr_cache_get(const char *path, struct stat *statbuf) {
+  struct attr_entry *e = attr_cache_lookup(path);
+  if (e == NULL || e->stale)
+    return -1;
+  if (e->err)
+    return e->err;
+  *statbuf = e->statbuf;
+  return 0;
+}
+
+static void free_dir_page(struct remote_file *f) {
+  if (f->dir) {
+    free(f->dir->entries);
+    free(f->dir);
+    f->dir = NULL;
+  }
+}
+
+static int alloc_remote_fd(int shard, int sfd, int flags, const char *path) {
+  int i = free_hint;
+  while (i < MAXIMUM_FD && open_fds[i].flags)
+    i++;
+  if (i == MAXIMUM_FD) {
+    fprintf(stderr, "please consider to add MAXIMUM_FD\n");
+    exit(1);
+  }
+  free_hint = i + 1;
+  open_fds[i] = (struct remote_file){
+      .flags = flags, .shard = shard, .sfd = sfd, .path = strdup(path)};
+  return i;
+}
+
+static void free_remote_fd(int fd) {
+  free(open_fds[fd].path);
+  free_dir_page(&open_fds[fd]);
+  if (open_fds[fd].entry)
+    attr_entry_unref(open_fds[fd].entry);
+  free(open_fds[fd].fill);
+  open_fds[fd] = (struct remote_file){0};
+  if (fd < free_hint)
+    free_hint = fd;
+}
+
+// FNV-1a with a final avalanche so similar paths land far apart on the ring.
+static uint64_t ring_hash(const char *key, size_t len) {
+  uint64_t h = strong_sum((const unsigned char *)key, len);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static int ring_cmp(const void *a, const void *b) {
+  uint64_t x = ((const struct ring_point *)a)->hash;
+  uint64_t y = ((const struct ring_point *)b)->hash;
+  return x < y ? -1 : x > y;
+}
+
+// Picks the shard owning the directory `dir` (`len` bytes, no trailing
+// slash): the first ring point at or after its hash.
+static int ring_shard(const char *dir, size_t len) {
+  // every remote operation starts with a path, so connect here on first use
+  if (!client_ready)
+    initialize_client();
+  if (nshards == 1)
+    return 0;
+  if (len == 1 && dir[0] == '.')
+    len = 0; // "." and "" both name the current directory
+  uint64_t h = ring_hash(dir, len);
+  int lo = 0, hi = nring;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (ring[mid].hash < h)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return ring[lo == nring ? 0 : lo].shard;
+}
+
+// The shard holding the entries of directory `path`.
+static int dir_shard(const char *path) {
+  size_t len = strlen(path);
+  while (len > 0 && path[len - 1] == '/')
+    len--;
+  return ring_shard(path, len);
+}
+
+// The shard holding `path`, which is the shard of its parent directory, so
+// that all entries of a directory are listed by one server.
+static int shard_for(const char *path) {
+  size_t len = strlen(path);
+  while (len > 0 && path[len - 1] == '/')
+    len--;
+  while (len > 0 && path[len - 1] != '/')
+    len--;
+  while (len > 0 && path[len - 1] == '/')
+    len--;
+  return ring_shard(path, len);
+}
+
+static void set_addr(struct shard *sh, const char *serverip,
+                     const char *serverport) {
+  memset(&sh->addr, 0, sizeof(sh->addr));
+  sh->addr.sin_family = AF_INET;
+  sh->addr.sin_addr.s_addr = inet_addr(serverip);
+  sh->addr.sin_port = htons((unsigned short)atoi(serverport));
+}
+
+static void add_shard(const char *serverip, const char *serverport) {
+  if (nshards == MAX_SHARDS)
+    errx(1, "[mylib.c]: at most %d servers are supported", MAX_SHARDS);
+  set_addr(&shards[nshards], serverip, serverport);
+
+  for (int v = 0; v < SHARD_VNODES; v++) {
+    char key[64];
+    int len = snprintf(key, sizeof(key), "%s:%s#%d", serverip, serverport, v);
+    ring[nring].hash = ring_hash(key, len);
+    ring[nring].shard = nshards;
+    nring++;
+  }
+  nshards++;
+}
+
+static void add_stripe(const char *serverip, const char *serverport) {
+  if (nstripes == MAX_STRIPES)
+    errx(1, "[mylib.c]: at most %d stripes are supported", MAX_STRIPES);
+  set_addr(&shards[nshards + nstripes], serverip, serverport);
+  nstripes++;
+}
+
+// Calls `add` for every entry of a "ip:port,ip:port,..." list.
+static void parse_server_list(const char *name, const char *servers,
+                              void (*add)(const char *, const char *)) {
+  fprintf(stderr, "Got environment variable %s: %s\n", name, servers);
+  char *list = strdup(servers);
+  char *save;
+  for (char *s = strtok_r(list, ",", &save); s;
+       s = strtok_r(NULL, ",", &save)) {
+    char *colon = strrchr(s, ':');
+    if (colon == NULL)
+      errx(1, "[mylib.c]: expected ip:port in %s, got %s", name, s);
+    *colon = '\0';
+    add(s, colon + 1);
+  }
+  free(list);
+}
+
 void initialize_client() {
   char *serverip;
   char *serverport;
-  unsigned short port;
-  int rv;
-  struct sockaddr_in srv;
-
-  serverip = getenv("server15440");
-  if (serverip)
-    fprintf(stderr, "Got environment variable server15440: %s\n", serverip);
-  else {
-    fprintf(stderr,
-            "Environment variable server15440 not found.  Using 127.0.0.1\n");
-    serverip = "127.0.0.1";
+  char *servers;
+
+  // servers15440 lists shards as "ip:port,ip:port,..."
+  servers = getenv("servers15440");
+  if (servers)
+    parse_server_list("servers15440", servers, add_shard);
+
+  if (nshards == 0) {
+    serverip = getenv("server15440");
+    if (serverip)
+      fprintf(stderr, "Got environment variable server15440: %s\n", serverip);
+    else {
+      fprintf(stderr,
+              "Environment variable server15440 not found.  Using 127.0.0.1\n");
+      serverip = "127.0.0.1";
+    }
+
+    serverport = getenv("serverport15440");
+    if (serverport)
+      fprintf(stderr, "Got environment variable serverport15440: %s\n",
+              serverport);
+    else {
+      fprintf(stderr,
+              "Environment variable serverport15440 not found.  Using 15440\n");
+      serverport = "15440";
+    }
+    add_shard(serverip, serverport);
+  }
+  qsort(ring, nring, sizeof(struct ring_point), ring_cmp);
+
+  // stripes15440 lists extra connections for striped reads; they must serve
+  // the same files, and may repeat a server to get several streams to it
+  servers = getenv("stripes15440");
+  if (servers)
+    parse_server_list("stripes15440", servers, add_stripe);
+
+  for (int i = 0; i < nshards + nstripes; i++) {
+    shards[i].msockfd = -1;
+    shards[i].csockfd = -1;
+    shards[i].sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (shards[i].sockfd < 0)
+      err(1, 0);
+    if (connect(shards[i].sockfd, (struct sockaddr *)&shards[i].addr,
+                sizeof(struct sockaddr)) < 0)
+      err(1, 0);
   }
 
-  serverport = getenv("serverport15440");
-  if (serverport)
-    fprintf(stderr, "Got environment variable serverport15440: %s\n",
-            serverport);
-  else {
-    fprintf(stderr,
-            "Environment variable serverport15440 not found.  Using 15440\n");
-    serverport = "15440";
+  uint32_t features = 0;
+  char *crc = getenv("crc15440");
+  if (crc && atoi(crc))
+    features |= FEAT_CRC32C;
+  char *meta = getenv("metachannel15440");
+  if (meta && atoi(meta))
+    features |= FEAT_META_CHANNEL;
+  char *sparse = getenv("sparse15440");
+  if (!sparse || atoi(sparse))
+    features |= FEAT_SPARSE;
+  char *lease = getenv("leases15440");
+  if (lease && atoi(lease))
+    features |= FEAT_LEASES;
+  negotiate_features(features);
+  client_ready = 1;
+}
+
+static unsigned char mount_key(const char *path) {
+  return (unsigned char)(path[0] == '/' ? path[1] : path[0]);
+}
+
+static void add_mount(const char *prefix, size_t len) {
+  while (len > 1 && prefix[len - 1] == '/')
+    len--;
+  if (len == 0)
+    return;
+  if (nmounts == MAX_MOUNTS)
+    errx(1, "[mylib.c]: at most %d mounts are supported", MAX_MOUNTS);
+  nmounts++;
+  if (len == 1 && prefix[0] == '/') {
+    mount_root = 1;
+    return;
+  }
+  if (len == 1 && prefix[0] == '.') {
+    mount_cwd = 1;
+    return;
+  }
+  struct mount *m = malloc(sizeof(struct mount) + len + 1);
+  m->len = len;
+  memcpy(m->prefix, prefix, len);
+  m->prefix[len] = '\0';
+  m->next = mounts[mount_key(m->prefix)];
+  mounts[mount_key(m->prefix)] = m;
+}
+
+// Reads remote mount prefixes from mounts15440 ("/a:/b/c:...") and from the
+// file named by mountfile15440 (one per line, '#' starts a comment).
+// Relative prefixes match relative paths, which the servers resolve.
+void initialize_mounts() {
+  char *list = getenv("mounts15440");
+  while (list && *list) {
+    size_t len = strcspn(list, ":");
+    add_mount(list, len);
+    list += list[len] ? len + 1 : len;
+  }
+
+  char *file = getenv("mountfile15440");
+  if (file == NULL)
+    return;
+  FILE *fp = fopen(file, "r");
+  if (fp == NULL)
+    err(1, "[mylib.c]: %s", file);
+  char line[PATH_MAX];
+  while (fgets(line, sizeof(line), fp)) {
+    char *p = line + strspn(line, " \t");
+    add_mount(p, strcspn(p, "# \t\n"));
+  }
+  fclose(fp);
+}
+
+// Whether `path` lies under a remote mount: the prefix has to end at a
+// component boundary of the path as given.
+static int remote_path(const char *path) {
+  if (nmounts == 0)
+    return 1;
+  if (path[0] == '/' ? mount_root : mount_cwd)
+    return 1;
+  for (struct mount *m = mounts[mount_key(path)]; m; m = m->next)
+    if (strncmp(path, m->prefix, m->len) == 0 &&
+        (path[m->len] == '\0' || path[m->len] == '/'))
+      return 1;
+  return 0;
+}
+
+// Drops the first `n` bytes from an iovec array in place, returning the number
+// of entries that still have data left.
+static int iov_advance(struct iovec **iov, int cnt, size_t n) {
+  while (cnt > 0 && n >= (*iov)->iov_len) {
+    n -= (*iov)->iov_len;
+    (*iov)++;
+    cnt--;
+  }
+  if (cnt > 0) {
+    (*iov)->iov_base = (char *)(*iov)->iov_base + n;
+    (*iov)->iov_len -= n;
+  }
+  return cnt;
+}
+
+// Copies at most `limit` bytes worth of iovecs from `src` into `dst`, skipping
+// the first `skip` bytes. Returns the number of entries written.
+static int iov_slice(struct iovec *dst, const struct iovec *src, int cnt,
+                     size_t skip, size_t limit) {
+  int n = 0;
+  for (int i = 0; i < cnt && limit > 0; i++) {
+    if (skip >= src[i].iov_len) {
+      skip -= src[i].iov_len;
+      continue;
+    }
+    size_t len = src[i].iov_len - skip;
+    if (len > limit)
+      len = limit;
+    dst[n].iov_base = (char *)src[i].iov_base + skip;
+    dst[n].iov_len = len;
+    limit -= len;
+    skip = 0;
+    n++;
   }
-  port = (unsigned short)atoi(serverport);
+  return n;
+}
 
-  sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sockfd < 0)
-    err(1, 0);
+static void sendv_all(int sockfd, struct iovec *iov, int cnt) {
+  while (cnt > 0) {
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = cnt};
+    ssize_t n = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      err(1, "[mylib.c]: sendmsg");
+    }
+    cnt = iov_advance(&iov, cnt, n);
+  }
+}
+
+// Adds the first `n` bytes described by `iov` to a CRC32C.
+static uint32_t crc_iov(uint32_t crc, const struct iovec *iov, size_t n) {
+  for (; n > 0; iov++) {
+    size_t len = n < iov->iov_len ? n : iov->iov_len;
+    crc = crc32c(crc, iov->iov_base, len);
+    n -= len;
+  }
+  return crc;
+}
+
+// Expands the `data_len` bytes at the start of buf, the data of a sparse
+// READ/PREAD response, into the `nbyte` bytes of the file range it covers by
+// moving the data between the `nholes` holes of `holes_wire` into place and
+// zeroing the holes. Returns -1 if the holes don't fit the data.
+static int expand_holes(char *buf, size_t data_len, size_t nbyte,
+                        const unsigned char *holes_wire, uint32_t nholes) {
+  read_hole holes[SPARSE_MAX_HOLES];
+  for (uint32_t i = 0; i < nholes; i++)
+    holes_wire = wire_read_hole_decode(holes_wire, &holes[i]);
+  // from the last hole back, so data is only ever moved towards the end
+  size_t src_end = data_len, dst_end = nbyte;
+  for (uint32_t i = nholes; i-- > 0;) {
+    if (holes[i].off > dst_end || holes[i].len > dst_end - holes[i].off)
+      return -1;
+    size_t after = dst_end - holes[i].off - holes[i].len;
+    if (after > src_end)
+      return -1;
+    memmove(buf + holes[i].off + holes[i].len, buf + src_end - after, after);
+    memset(buf + holes[i].off, 0, holes[i].len);
+    src_end -= after;
+    dst_end = holes[i].off;
+  }
+  return src_end == dst_end ? 0 : -1;
+}
+
+// Receives into all of `iov`. With `crc`, the data is also added to that
+// CRC32C as it arrives, while it is still in cache.
+static void recvv_all(int sockfd, struct iovec *iov, int cnt, uint32_t *crc) {
+  while (cnt > 0) {
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = cnt};
+    ssize_t n = recvmsg(sockfd, &msg, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      errx(1, "[mylib.c]: connection to server lost");
+    if (crc)
+      *crc = crc_iov(*crc, iov, n);
+    cnt = iov_advance(&iov, cnt, n);
+  }
+}
+
+// The connection of `shard` that carries `opcode`: metadata operations go
+// over the metadata channel when there is one, and RELEASEs over the
+// callback channel.
+static int shard_sock(int shard, int opcode) {
+  switch (opcode) {
+  case ATTACH:
+    return attach_sock;
+  case RELEASE:
+    return shards[shard].csockfd;
+  case OPEN:
+  case STAT:
+  case UNLINK:
+  case CLOSE:
+  case LSEEK:
+  case LEASE:
+    if (shards[shard].msockfd >= 0)
+      return shards[shard].msockfd;
+  }
+  return shards[shard].sockfd;
+}
+
+static void rpc_send(int shard, const struct iovec *req_iov, int req_cnt);
+
+// Drops the cache entries under lease `id` but `keep`; fds using them
+// notice.
+static void lease_drop_entries(uint64_t id, const struct attr_entry *keep) {
+  for (int i = 0; i < ATTR_CACHE_BUCKETS; i++) {
+    struct attr_entry **link = &attr_cache[i];
+    while (*link) {
+      if (*link != keep && (*link)->lease == id)
+        attr_cache_unlink(link, 1);
+      else
+        link = &(*link)->next;
+    }
+  }
+}
+
+// Stops using lease `id` and gives it back to `shard`.
+static void lease_release(int shard, uint64_t id) {
+  lease_drop_entries(id, NULL);
+  recalled[recalled_next] = id;
+  recalled_next = (recalled_next + 1) % RECALLED_IDS;
+  request r = {.header.opcode = RELEASE, .req.release.lease = id};
+  struct iovec req_iov[] = {{&r, sizeof(r)}};
+  rpc_send(shard, req_iov, 1);
+}
+
+// Handles the RECALLs that have arrived on the callback channels, without
+// blocking.
+static void leases_poll() {
+  for (int i = 0; i < nshards; i++) {
+    struct shard *sh = &shards[i];
+    while (sh->csockfd >= 0) {
+      ssize_t n = recv(sh->csockfd, sh->recall + sh->recall_len,
+                       sizeof(sh->recall) - sh->recall_len, MSG_DONTWAIT);
+      if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        break;
+      if (n <= 0)
+        errx(1, "[mylib.c]: callback channel to server %d lost", i);
+      sh->recall_len += n;
+      if (sh->recall_len < sizeof(sh->recall))
+        continue;
+      sh->recall_len = 0;
+      response res;
+      wire_res_header_decode(sh->recall, &res.header);
+      wire_recall_res_decode(sh->recall + WIRE_HEADER_SIZE, &res.res);
+      if (res.header.payload_len != WIRE_SIZE_recall_res)
+        errx(1, "[mylib.c]: malformed RECALL");
+      fprintf(stderr, "[mylib.c]: lease %lx recalled\n",
+              (unsigned long)res.res.recall.lease);
+      lease_release(i, res.res.recall.lease);
+    }
+  }
+}
 
-  memset(&srv, 0, sizeof(srv));
-  srv.sin_family = AF_INET;
-  srv.sin_addr.s_addr = inet_addr(serverip);
-  srv.sin_port = htons(port);
+// Waits for a response on `sockfd`, answering RECALLs meanwhile: the server
+// may be holding the request back until leases of ours are returned.
+static void await_response(int sockfd) {
+  struct pollfd pfds[1 + MAX_SHARDS];
+  pfds[0] = (struct pollfd){.fd = sockfd, .events = POLLIN};
+  for (int i = 0; i < nshards; i++)
+    pfds[1 + i] = (struct pollfd){.fd = shards[i].csockfd, .events = POLLIN};
+  while (1) {
+    if (poll(pfds, 1 + nshards, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      err(1, "[mylib.c]: poll");
+    }
+    if (pfds[0].revents)
+      return;
+    leases_poll();
+  }
+}
 
-  rv = connect(sockfd, (struct sockaddr *)&srv, sizeof(struct sockaddr));
-  if (rv < 0)
-    err(1, 0);
+// The first entry of `req_iov` is the request struct, which is sent as its
+// wire encoding; the remaining entries are sent as they are, followed by
+// their CRC32C for the requests that carry one.
+static void rpc_send(int shard, const struct iovec *req_iov, int req_cnt) {
+  request *r = req_iov[0].iov_base;
+  unsigned char wire[WIRE_HEADER_SIZE + WIRE_MAX_BODY];
+  unsigned char *end =
+      wire_req_encode(r->header.opcode, wire + WIRE_HEADER_SIZE, &r->req);
+  struct iovec iov[RPC_MAXIOV] = {{wire, end - wire}};
+  r->header.payload_len = end - wire - WIRE_HEADER_SIZE;
+  size_t data_len = 0;
+  for (int i = 1; i < req_cnt; i++) {
+    iov[i] = req_iov[i];
+    data_len += req_iov[i].iov_len;
+  }
+  r->header.payload_len += data_len;
+  // checksummed right before the send, so the kernel copies the data from
+  // cache. Sending it in checksummed pieces instead costs a wakeup of the
+  // server per piece, which was slower.
+  unsigned char sum_wire[WIRE_CRC_SIZE];
+  if (shards[shard].crc && wire_req_crc(r->header.opcode)) {
+    wire_put_u32(sum_wire, crc_iov(0, iov + 1, data_len));
+    iov[req_cnt++] = (struct iovec){sum_wire, WIRE_CRC_SIZE};
+    r->header.payload_len += WIRE_CRC_SIZE;
+  }
+  wire_req_header_encode(wire, &r->header);
+  sendv_all(shard_sock(shard, r->header.opcode), iov, req_cnt);
 }
 
-void makerpc(request *h, response *r) {
-  size_t len = sizeof(req_header) + h->header.payload_len;
-  send(sockfd, (void *)h, len, 0);
+// Receives the response to an `opcode` request. The first entry of `res_iov`
+// is the response struct the header and fixed fields are decoded into; the
+// variable part is scattered from where message.h puts it in that struct on.
+static void rpc_recv(int shard, int opcode, const struct iovec *res_iov,
+                     int res_cnt) {
+  int sockfd = shard_sock(shard, opcode);
+  response *res = res_iov[0].iov_base;
+  unsigned char wire[WIRE_HEADER_SIZE + WIRE_MAX_BODY];
+  size_t fixed = wire_res_size(opcode);
+  struct iovec iov[RPC_MAXIOV] = {{wire, WIRE_HEADER_SIZE + fixed}};
+  if (leases_on)
+    await_response(sockfd);
+  recvv_all(sockfd, iov, 1, NULL);
+  wire_res_header_decode(wire, &res->header);
+  wire_res_decode(opcode, wire + WIRE_HEADER_SIZE, &res->res);
+  int crc = shards[shard].crc && wire_res_crc(opcode);
+  size_t trailer = crc ? WIRE_CRC_SIZE : 0;
+  if (res->header.payload_len < fixed + trailer)
+    errx(1, "[mylib.c]: malformed response");
+
+  size_t payload_len = res->header.payload_len - fixed - trailer;
+  size_t holes_len = 0;
+  if (opcode == READ || opcode == PREAD) {
+    holes_len = (size_t)res->res.read.nholes * WIRE_SIZE_read_hole;
+    if (res->res.read.nholes > SPARSE_MAX_HOLES || payload_len < holes_len)
+      errx(1, "[mylib.c]: malformed response");
+    payload_len -= holes_len;
+  }
+  uint32_t sum = 0;
+  int cnt = iov_slice(iov, res_iov, res_cnt,
+                      offsetof(response, res) + wire_res_tail(opcode),
+                      payload_len);
+  size_t capacity = 0;
+  for (int i = 0; i < cnt; i++)
+    capacity += iov[i].iov_len;
+  recvv_all(sockfd, iov, cnt, crc ? &sum : NULL);
+
+  char scratch[BUFLEN];
+  while (capacity < payload_len) {
+    size_t len = payload_len - capacity;
+    iov[0].iov_base = scratch;
+    iov[0].iov_len = len < BUFLEN ? len : BUFLEN;
+    capacity += iov[0].iov_len;
+    recvv_all(sockfd, iov, 1, crc ? &sum : NULL);
+  }
+
+  unsigned char holes_wire[SPARSE_MAX_HOLES * WIRE_SIZE_read_hole];
+  if (holes_len) {
+    iov[0] = (struct iovec){holes_wire, holes_len};
+    recvv_all(sockfd, iov, 1, crc ? &sum : NULL);
+  }
 
-  len = sizeof(response_header);
-  size_t read_cnt = 0;
-  while (read_cnt < len) {
-    read_cnt += recv(sockfd, (char *)r + read_cnt, len - read_cnt, 0);
+  if (crc) {
+    unsigned char sum_wire[WIRE_CRC_SIZE];
+    iov[0] = (struct iovec){sum_wire, WIRE_CRC_SIZE};
+    recvv_all(sockfd, iov, 1, NULL);
+    if (wire_get_u32(sum_wire) != sum) {
+      fprintf(stderr, "[mylib.c]: checksum mismatch in read data\n");
+      res->header.errno_value = EIO;
+      res->res.read.nbyte = -1;
+    }
   }
 
-  size_t payload_len = r->header.payload_len;
-  read_cnt = 0;
-  while (read_cnt < payload_len) {
-    read_cnt +=
-        recv(sockfd, (char *)r + len + read_cnt, payload_len - read_cnt, 0);
+  // the data of a sparse read is expanded into the caller's buffer, which
+  // READ and PREAD responses are always received into in one piece
+  if (holes_len && res->res.read.nbyte >= 0) {
+    size_t nbyte = res->res.read.nbyte;
+    cnt = iov_slice(iov, res_iov, res_cnt,
+                    offsetof(response, res) + wire_res_tail(opcode), nbyte);
+    if (cnt != 1 || iov[0].iov_len != nbyte ||
+        expand_holes(iov[0].iov_base, payload_len, nbyte, holes_wire,
+                     res->res.read.nholes) < 0)
+      errx(1, "[mylib.c]: malformed sparse read response");
   }
 }
 
+// Sends the request described by `req_iov` to `shard` and receives the
+// response into `res_iov`. The first entry of `req_iov` must be the request
+// struct; its payload_len is filled in from the total length. The first entry
+// of `res_iov` must be the response struct; the variable part of the payload
+// is scattered over the rest of it and the other entries, and any bytes that
+// do not fit are discarded.
+void makerpc(int shard, const struct iovec *req_iov, int req_cnt,
+             const struct iovec *res_iov, int res_cnt) {
+  rpc_send(shard, req_iov, req_cnt);
+  rpc_recv(shard, ((request *)req_iov[0].iov_base)->header.opcode, res_iov,
+           res_cnt);
+}
+
 // The following line declares a function pointer with the same prototype as the
 // open function.
 int (*orig_open)(const char *pathname, int flags,
@@ -146,70 +1021,771 @@ ssize_t (*orig_getdirentries)(int fd, char *buf, size_t nbytes,
 struct dirtreenode *(*orig_getdirtree)(const char *path);
 void (*orig_freedirtree)(struct dirtreenode *dt);
 
+// Opens a new connection to `shard` and attaches it to the session of its
+// first connection with the token the server handed out for the `what`
+// channel. Returns the connection, or -1.
+static int attach_channel(int shard, uint64_t token, const char *what) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&shards[shard].addr,
+                        sizeof(struct sockaddr)) < 0) {
+    fprintf(stderr, "[mylib.c]: %s channel to server %d: %s\n", what, shard,
+            strerror(errno));
+    if (fd >= 0)
+      orig_close(fd);
+    return -1;
+  }
+  attach_sock = fd;
+  request r = {.header.opcode = ATTACH, .req.attach.token = token};
+  struct iovec req_iov[] = {{&r, sizeof(r)}};
+  response res;
+  struct iovec res_iov[] = {{&res, sizeof(res)}};
+  makerpc(shard, req_iov, 1, res_iov, 1);
+  attach_sock = -1;
+  if (res.res.close.ret_val < 0) {
+    fprintf(stderr, "[mylib.c]: server %d refused the %s channel\n", shard,
+            what);
+    orig_close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Asks every connection for `features` (FEAT_*), pipelined. Stripe
+// connections only carry PREADs, so they get no metadata channel and no
+// leases. All of them name the same random client id, so a server schedules
+// this process as one client however many connections it has.
+static void negotiate_features(uint32_t features) {
+  request r = {.header.opcode = OPTIONS};
+  if (getrandom(&r.req.options.client, sizeof(uint64_t), 0) != sizeof(uint64_t))
+    r.req.options.client = 0;
+  struct iovec req_iov[] = {{&r, sizeof(r)}};
+  response res;
+  struct iovec res_iov[] = {{&res, sizeof(res)}};
+  uint64_t tokens[MAX_SHARDS], lease_tokens[MAX_SHARDS];
+  for (int i = 0; i < nshards + nstripes; i++) {
+    r.req.options.features =
+        i < nshards ? features
+                    : features & ~(FEAT_META_CHANNEL | FEAT_LEASES);
+    rpc_send(i, req_iov, 1);
+  }
+  for (int i = 0; i < nshards + nstripes; i++) {
+    rpc_recv(i, OPTIONS, res_iov, 1);
+    shards[i].crc = (res.res.options.features & FEAT_CRC32C) != 0;
+    if ((features & FEAT_CRC32C) && !shards[i].crc)
+      fprintf(stderr, "[mylib.c]: server %d declined payload checksums\n", i);
+    if (i < nshards) {
+      tokens[i] = res.res.options.features & FEAT_META_CHANNEL
+                      ? res.res.options.token
+                      : 0;
+      lease_tokens[i] = res.res.options.features & FEAT_LEASES
+                            ? res.res.options.lease_token
+                            : 0;
+    }
+  }
+  for (int i = 0; i < nshards && (features & FEAT_META_CHANNEL); i++) {
+    if (tokens[i])
+      shards[i].msockfd = attach_channel(i, tokens[i], "metadata");
+    else
+      fprintf(stderr, "[mylib.c]: server %d declined a metadata channel\n", i);
+  }
+
+  // leases are only safe to rely on if every shard recalls them
+  int attached = 0;
+  for (int i = 0; i < nshards && (features & FEAT_LEASES); i++) {
+    if (lease_tokens[i] &&
+        (shards[i].csockfd = attach_channel(i, lease_tokens[i], "callback")) >=
+            0)
+      attached++;
+    else
+      fprintf(stderr, "[mylib.c]: server %d declined leases\n", i);
+  }
+  leases_on = attached == nshards && (features & FEAT_LEASES);
+  for (int i = 0; i < nshards && !leases_on; i++) {
+    if (shards[i].csockfd >= 0)
+      orig_close(shards[i].csockfd);
+    shards[i].csockfd = -1;
+  }
+}
+
+static void lease_send(int shard, const char *path, int mode) {
+  request r = {.header.opcode = LEASE, .req.lease.mode = mode};
+  struct iovec req_iov[] = {
+      {&r, offsetof(request, req.lease.pathname)},
+      {(void *)path, strlen(path) + 1},
+  };
+  rpc_send(shard, req_iov, 2);
+}
+
+// Receives the answer to lease_send() into `res` and caches the attributes,
+// or the absence of `path`, under the lease that came with them, whose term
+// runs from `sent`. Returns the cache entry, or NULL if there is no lease.
+static struct attr_entry *lease_recv(int shard, const char *path, long sent,
+                                     response *res) {
+  struct iovec res_iov[] = {{res, sizeof(*res)}};
+  rpc_recv(shard, LEASE, res_iov, 1);
+  lease_res *lr = &res->res.lease;
+  int err = lr->ret_val < 0 ? res->header.errno_value : 0;
+  if (!lr->lease || (err && err != ENOENT))
+    return NULL;
+  // the RECALL may have overtaken the response
+  for (int i = 0; i < RECALLED_IDS; i++)
+    if (recalled[i] == lr->lease)
+      return NULL;
+
+  // under the same lease nothing changed but our own writes, which the
+  // data already has
+  struct attr_entry *e = attr_cache_insert(path, lr->lease);
+  if (err || e->statbuf.st_size != lr->statbuf.st_size)
+    attr_entry_drop_data(e);
+  e->err = err;
+  if (!err)
+    e->statbuf = lr->statbuf;
+  e->lease = lr->lease;
+  e->mode = lr->mode;
+  e->stale = 0;
+  e->expires = sent + lr->term_ms * 1000000L;
+  // writes under a delegation only update the entry of the path written
+  // through, so other names of the file must not be cached under it
+  if (e->mode == LEASE_WRITE)
+    lease_drop_entries(e->lease, e);
+  return e;
+}
+
+// Gives open fd `f` the lease cached for its path, if any: read-only fds
+// collect the file's content for later opens, and fds of a write delegation
+// keep the cached content and size up to date.
+static void lease_attach(struct remote_file *f, int flags) {
+  struct attr_entry *e = attr_cache_lookup(f->path);
+  if (e == NULL || !e->lease || e->err || !S_ISREG(e->statbuf.st_mode))
+    return;
+  size_t size = e->statbuf.st_size;
+  if ((flags & O_ACCMODE) == O_RDONLY) {
+    if (e->data || size > LEASE_DATA_MAX ||
+        lease_data_bytes + (long)size > LEASE_DATA_TOTAL)
+      return;
+    if (size == 0) {
+      e->data = malloc(1);
+      return;
+    }
+    f->fill = malloc(size);
+    f->fill_len = 0;
+  } else if (e->mode != LEASE_WRITE) {
+    return;
+  }
+  f->entry = e;
+  e->refs++;
+  f->pos = flags & O_APPEND ? (off_t)size : 0;
+}
+
+// Adds the result of a read at f->pos - n to the content being collected.
+// Once it is complete, and the lease still valid, it is cached.
+static void lease_fill(struct remote_file *f, const char *buf, ssize_t n) {
+  struct attr_entry *e = f->entry;
+  size_t size = e->statbuf.st_size;
+  if (n > 0 && f->fill_len + n <= size) {
+    memcpy(f->fill + f->fill_len, buf, n);
+    f->fill_len += n;
+    if (f->fill_len < size)
+      return;
+  }
+  if (f->fill_len == size && n >= 0 && lease_valid(e) && !e->data &&
+      !e->stale && lease_data_bytes + (long)size <= LEASE_DATA_TOTAL) {
+    e->data = f->fill;
+    lease_data_bytes += size;
+    f->fill = NULL;
+  }
+  free(f->fill);
+  f->fill = NULL;
+}
+
+// Applies a write of `n` bytes through `f` to the entry of its write
+// delegation, under which no other session sees the file change.
+static void lease_wrote(struct remote_file *f, const void *buf, ssize_t n) {
+  struct attr_entry *e = f->entry;
+  if (n <= 0)
+    return;
+  off_t size = e->statbuf.st_size;
+  off_t pos = f->flags & FD_APPEND ? size : f->pos;
+  off_t end = pos + n;
+  if (end > LEASE_DATA_MAX ||
+      (end > size && lease_data_bytes + (end - size) > LEASE_DATA_TOTAL))
+    attr_entry_drop_data(e);
+  if (e->data && end > size) {
+    e->data = realloc(e->data, end);
+    if (pos > size)
+      memset(e->data + size, 0, pos - size);
+    lease_data_bytes += end - size;
+  }
+  if (e->data)
+    memcpy(e->data + pos, buf, n);
+  if (end > size)
+    e->statbuf.st_size = end;
+  e->stale = 1; // times, and the size of files without data
+  f->pos = end;
+}
+
+// Serves a read of fd `f` from the content cached under its lease.
+static ssize_t local_read(struct remote_file *f, void *buf, size_t nbyte) {
+  struct attr_entry *e = f->entry;
+  size_t n = f->pos < e->statbuf.st_size ? e->statbuf.st_size - f->pos : 0;
+  if (n > nbyte)
+    n = nbyte;
+  memcpy(buf, e->data + f->pos, n);
+  f->pos += n;
+  return n;
+}
+
+// Opens the file of local fd `f` on its server at the offset read so far,
+// once its lease is gone. Fails with ESTALE if the file can't be opened.
+static int promote_local_fd(struct remote_file *f) {
+  request r = {.header.opcode = OPEN, .req.open.flags = O_RDONLY};
+  struct iovec req_iov[] = {
+      {&r, offsetof(request, req.open.pathname)},
+      {f->path, strlen(f->path) + 1},
+  };
+  response res;
+  struct iovec res_iov[] = {{&res, sizeof(res)}};
+  makerpc(f->shard, req_iov, 2, res_iov, 1);
+  if (res.res.open.ret_val < 0) {
+    errno = ESTALE;
+    return -1;
+  }
+  f->sfd = res.res.open.ret_val;
+  if (f->pos > 0) {
+    request l = {.header.opcode = LSEEK,
+                 .req.lseek = {.fd = f->sfd, .offset = f->pos,
+                               .whence = SEEK_SET}};
+    struct iovec lseek_iov[] = {{&l, sizeof(l)}};
+    makerpc(f->shard, lseek_iov, 1, res_iov, 1);
+  }
+  f->flags &= ~FD_LOCAL;
+  attr_entry_unref(f->entry);
+  f->entry = NULL;
+  return 0;
+}
+
+// Whether local fd `f` still has its lease; if not, it is promoted to a
+// remote one, which may fail.
+static int local_fd_valid(struct remote_file *f) {
+  leases_poll();
+  if (lease_valid(f->entry))
+    return 1;
+  if (promote_local_fd(f) < 0)
+    return -1;
+  return 0;
+}
+
 // This is our replacement for the open function from libc.
-int open(const char *pathname, int flags, ...) {
-  mode_t m = 0;
+static int do_open(const char *pathname, int flags, mode_t m) {
+  if (!remote_path(pathname))
+    return orig_open(pathname, flags, m);
+
+  // writable files may later be rewritten with DELTA, so ask the server to
+  // keep them readable and their old content around until it is replaced
+  int delta = (flags & O_ACCMODE) != O_RDONLY && !(flags & O_APPEND);
+
+  struct stat st;
   if (flags & O_CREAT) {
-    va_list a;
-    va_start(a, flags);
-    m = va_arg(a, mode_t);
-    va_end(a);
+    // whatever the outcome, lookups in this directory may now succeed
+    (*dir_gen(pathname))++;
+    attr_cache_drop(pathname);
+  } else if (attr_cache_get(pathname, &st) == ENOENT) {
+    errno = ENOENT;
+    return -1;
   }
 
-  int pathname_len = strlen(pathname) + 1;
-  int len = sizeof(request) + pathname_len;
-  request *r = malloc(len);
-
-  r->header.opcode = OPEN;
-  r->header.payload_len = sizeof(union req_union) + pathname_len;
+  int shard = shard_for(pathname);
+  int rdonly = (flags & O_ACCMODE) == O_RDONLY && !(flags & O_DIRECTORY);
+  int lease_mode = 0;
+  if (leases_on && !(flags & O_DIRECTORY)) {
+    // read-only opens of files whose content is cached stay local
+    struct attr_entry *e = attr_cache_lookup(pathname);
+    if (rdonly && !(flags & O_TRUNC) && e && e->data &&
+        S_ISREG(e->statbuf.st_mode)) {
+      int fd = alloc_remote_fd(shard, -1, FD_OPEN | FD_RDONLY | FD_LOCAL,
+                               pathname);
+      open_fds[fd].entry = e;
+      e->refs++;
+      return fd + REMOTE_FD;
+    }
+    // ask for a lease along with the open, unless a valid one is cached.
+    // Writers ask for a delegation.
+    if (rdonly)
+      lease_mode = e && e->lease ? 0 : LEASE_READ;
+    else
+      lease_mode = LEASE_WRITE;
+  }
 
-  r->req.open.flags = flags;
-  r->req.open.m = m;
-  memcpy(r->req.open.pathname, pathname, pathname_len);
+  request r = {
+      .header.opcode = OPEN,
+      .header.flags = delta ? REQ_OPEN_DELTA : 0,
+      .req.open.flags = flags,
+      .req.open.m = m,
+  };
+  struct iovec req_iov[] = {
+      {&r, offsetof(request, req.open.pathname)},
+      {(void *)pathname, strlen(pathname) + 1},
+  };
 
-  response *res = malloc(MAXMSGLEN);
-  makerpc(r, res);
+  response res;
+  struct iovec res_iov[] = {{&res, sizeof(res)}};
+  long sent = now_ns();
+  rpc_send(shard, req_iov, 2);
+  if (lease_mode)
+    lease_send(shard, pathname, lease_mode);
+  rpc_recv(shard, OPEN, res_iov, 1);
 
   fprintf(stderr, "[mylib.c]: rpc open return value: %d, errno: %d\n",
-          res->res.open.ret_val, res->header.errno_value);
-
-  free(r);
-  errno = res->header.errno_value;
-  int ret_val = res->res.open.ret_val;
-  free(res);
+          res.res.open.ret_val, res.header.errno_value);
+
+  int err = res.header.errno_value;
+  int ret_val = res.res.open.ret_val;
+  if (ret_val != -1 && (flags & O_TRUNC))
+    attr_cache_drop(pathname);
+  if (lease_mode) {
+    response lres;
+    lease_recv(shard, pathname, sent, &lres);
+  }
+  errno = err;
   if (ret_val == -1) {
+    if (errno == ENOENT && !(flags & O_CREAT))
+      neg_cache_put(pathname);
+    else if (errno == ENOENT && nshards > 1)
+      fprintf(stderr, "[mylib.c]: cannot create %s: its directory is missing "
+                      "on server %d; directories must exist on every server\n",
+              pathname, shard);
     return ret_val;
   }
-  open_fds[ret_val] = 1;
-  return ret_val + REMOTE_FD;
+  int fd_flags = FD_OPEN;
+  if (delta)
+    fd_flags |= FD_DELTA;
+  if (rdonly)
+    fd_flags |= FD_RDONLY;
+  if (flags & O_APPEND)
+    fd_flags |= FD_APPEND;
+  int fd = alloc_remote_fd(shard, ret_val, fd_flags, pathname);
+  if (leases_on && !(flags & O_DIRECTORY))
+    lease_attach(&open_fds[fd], flags);
+  errno = err;
+  return fd + REMOTE_FD;
 }
 
-ssize_t read(int fildes, void *buf, size_t nbyte) {
+// Opens the file behind `f` on every stripe connection and switches it to
+// client-tracked offsets. Returns -1 if no stripe could open it.
+static int start_striping(struct remote_file *f) {
+  request r = {.header.opcode = LSEEK,
+               .req.lseek = {.fd = f->sfd, .offset = 0, .whence = SEEK_CUR}};
+  struct iovec req_iov[] = {{&r, sizeof(r)}};
+  response res;
+  struct iovec res_iov[] = {{&res, sizeof(res)}};
+  makerpc(f->shard, req_iov, 1, res_iov, 1);
+  f->flags &= ~FD_RDONLY;
+  if (res.res.lseek.off < 0)
+    return -1;
+  f->pos = res.res.lseek.off;
+
+  // pipeline the opens: send all, then collect the fds
+  request o = {.header.opcode = OPEN, .req.open.flags = O_RDONLY};
+  struct iovec open_iov[] = {
+      {&o, offsetof(request, req.open.pathname)},
+      {f->path, strlen(f->path) + 1},
+  };
+  for (int i = 0; i < nstripes; i++)
+    rpc_send(nshards + i, open_iov, 2);
+  f->stripe_sfd = malloc(nstripes * sizeof(int));
+  int opened = 0;
+  for (int i = 0; i < nstripes; i++) {
+    rpc_recv(nshards + i, OPEN, res_iov, 1);
+    f->stripe_sfd[i] = res.res.open.ret_val;
+    opened += res.res.open.ret_val >= 0;
+  }
+  if (opened == 0) {
+    free(f->stripe_sfd);
+    f->stripe_sfd = NULL;
+    return -1;
+  }
+  f->flags |= FD_STRIPED;
+  return 0;
+}
+
+static void stop_striping(struct remote_file *f) {
+  request r = {.header.opcode = CLOSE};
+  struct iovec req_iov[] = {{&r, sizeof(r)}};
+  response res;
+  struct iovec res_iov[] = {{&res, sizeof(res)}};
+  for (int i = 0; i < nstripes; i++) {
+    if (f->stripe_sfd[i] >= 0) {
+      r.req.close.fd = f->stripe_sfd[i];
+      rpc_send(nshards + i, req_iov, 1);
+    }
+  }
+  for (int i = 0; i < nstripes; i++)
+    if (f->stripe_sfd[i] >= 0)
+      rpc_recv(nshards + i, CLOSE, res_iov, 1);
+  free(f->stripe_sfd);
+  f->stripe_sfd = NULL;
+}
+
+// One range of a striped read, received into the caller's buffer as it
+// arrives on its connection.
+struct stripe_io {
+  int sockfd;
+  char *buf;
+  size_t len;
+  size_t data_len; // bytes of data in the response, without its holes
+  response res;
+  unsigned char wire[WIRE_HEADER_SIZE + WIRE_SIZE_read_res];
+  struct iovec iov[RPC_MAXIOV];
+  struct iovec *cur;
+  int cnt;
+  int have_header;
+  int crc;          // the data is followed by its CRC32C
+  size_t data_left; // bytes of data and holes not received yet
+  uint32_t sum;
+  unsigned char holes[SPARSE_MAX_HOLES * WIRE_SIZE_read_hole];
+  unsigned char sum_wire[WIRE_CRC_SIZE];
+};
+
+// Reads `nbyte` bytes at f->pos. Large reads are split into one range per
+// stream (the file's shard plus every stripe that opened it); the PREADs are
+// all sent before any response is read, and responses are received with
+// poll() so the streams transfer in parallel.
+static ssize_t striped_read(struct remote_file *f, char *buf, size_t nbyte) {
+  int streams[1 + MAX_STRIPES], sfds[1 + MAX_STRIPES];
+  int n = 0;
+  streams[n] = f->shard;
+  sfds[n++] = f->sfd;
+  for (int i = 0; i < nstripes && nbyte >= STRIPE_MIN_READ; i++) {
+    if (f->stripe_sfd[i] >= 0) {
+      streams[n] = nshards + i;
+      sfds[n++] = f->stripe_sfd[i];
+    }
+  }
+  if (nbyte > n * (size_t)MAXMSGLEN)
+    nbyte = n * (size_t)MAXMSGLEN;
+  size_t chunk = (nbyte / n + 4095) & ~(size_t)4095;
+
+  struct stripe_io io[1 + MAX_STRIPES];
+  struct pollfd pfds[1 + MAX_STRIPES];
+  int nranges = 0;
+  for (size_t off = 0; off < nbyte || nranges == 0; off += chunk) {
+    struct stripe_io *s = &io[nranges];
+    s->buf = buf + off;
+    s->len = nbyte - off < chunk ? nbyte - off : chunk;
+    request r = {
+        .header.opcode = PREAD,
+        .req.pread = {.fd = sfds[nranges], .nbyte = s->len,
+                      .offset = f->pos + off},
+    };
+    struct iovec req_iov[] = {{&r, sizeof(r)}};
+    rpc_send(streams[nranges], req_iov, 1);
+
+    s->sockfd = shards[streams[nranges]].sockfd;
+    s->crc = shards[streams[nranges]].crc;
+    s->sum = 0;
+    s->iov[0] = (struct iovec){s->wire, sizeof(s->wire)};
+    s->iov[1] = (struct iovec){s->buf, s->len};
+    s->cur = s->iov;
+    s->cnt = 1;
+    s->have_header = 0;
+    pfds[nranges] = (struct pollfd){.fd = s->sockfd, .events = POLLIN};
+    nranges++;
+  }
+
+  int pending = nranges;
+  while (pending > 0) {
+    if (poll(pfds, nranges, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      err(1, "[mylib.c]: poll");
+    }
+    for (int i = 0; i < nranges; i++) {
+      struct stripe_io *s = &io[i];
+      if (!(pfds[i].revents & (POLLIN | POLLERR | POLLHUP)))
+        continue;
+      struct msghdr msg = {.msg_iov = s->cur, .msg_iovlen = s->cnt};
+      ssize_t got = recvmsg(s->sockfd, &msg, MSG_DONTWAIT);
+      if (got < 0 && (errno == EAGAIN || errno == EINTR))
+        continue;
+      if (got <= 0)
+        errx(1, "[mylib.c]: connection to server lost");
+      if (s->have_header && s->crc && s->data_left > 0) {
+        size_t data = (size_t)got < s->data_left ? (size_t)got : s->data_left;
+        s->sum = crc_iov(s->sum, s->cur, data);
+        s->data_left -= data;
+      }
+      s->cnt = iov_advance(&s->cur, s->cnt, got);
+      if (s->cnt == 0 && !s->have_header) {
+        // the rest of the payload is the data, received in place
+        wire_res_header_decode(s->wire, &s->res.header);
+        wire_read_res_decode(s->wire + WIRE_HEADER_SIZE, &s->res.res);
+        size_t payload_len = s->res.header.payload_len;
+        size_t trailer = s->crc ? WIRE_CRC_SIZE : 0;
+        size_t holes_len =
+            (size_t)s->res.res.read.nholes * WIRE_SIZE_read_hole;
+        if (s->res.res.read.nholes > SPARSE_MAX_HOLES ||
+            payload_len < WIRE_SIZE_read_res + holes_len + trailer ||
+            payload_len > WIRE_SIZE_read_res + holes_len + trailer + s->len)
+          errx(1, "[mylib.c]: malformed PREAD response");
+        s->data_left = payload_len - WIRE_SIZE_read_res - trailer;
+        s->data_len = s->data_left - holes_len;
+        s->iov[1].iov_len = s->data_len;
+        s->iov[2] = (struct iovec){s->holes, holes_len};
+        s->iov[3] = (struct iovec){s->sum_wire, trailer};
+        s->cur = s->iov + 1;
+        s->cnt = 3;
+        while (s->cnt > 0 && s->cur->iov_len == 0) {
+          s->cur++;
+          s->cnt--;
+        }
+        if (trailer == 0 && s->cnt > 0)
+          s->cnt--;
+        s->have_header = 1;
+      }
+      if (s->cnt == 0 && s->crc && wire_get_u32(s->sum_wire) != s->sum) {
+        fprintf(stderr, "[mylib.c]: checksum mismatch in read data\n");
+        s->res.header.errno_value = EIO;
+        s->res.res.read.nbyte = -1;
+      }
+      if (s->cnt == 0 && s->res.res.read.nholes > 0 &&
+          s->res.res.read.nbyte >= 0 &&
+          ((size_t)s->res.res.read.nbyte > s->len ||
+           expand_holes(s->buf, s->data_len, s->res.res.read.nbyte, s->holes,
+                        s->res.res.read.nholes) < 0))
+        errx(1, "[mylib.c]: malformed sparse PREAD response");
+      if (s->cnt == 0) {
+        pfds[i].fd = -1;
+        pending--;
+      }
+    }
+  }
+
+  // the result is the contiguous prefix of ranges that came back in full
+  ssize_t total = 0;
+  for (int i = 0; i < nranges; i++) {
+    ssize_t got = io[i].res.res.read.nbyte;
+    if (got < 0) {
+      if (i == 0) {
+        errno = io[i].res.header.errno_value;
+        return -1;
+      }
+      break;
+    }
+    total += got;
+    if ((size_t)got < io[i].len)
+      break;
+  }
+  f->pos += total;
+  return total;
+}
+
+static ssize_t remote_read(struct remote_file *f, void *buf, size_t nbyte);
+
+static ssize_t do_read(int fildes, void *buf, size_t nbyte) {
   fprintf(stderr, "[mylib.c]: read called for fildes %d\n", fildes);
 
   if (!remote_fd(fildes)) {
     return orig_read(fildes, buf, nbyte);
   }
-  fildes -= REMOTE_FD;
+  struct remote_file *f = &open_fds[fildes - REMOTE_FD];
+
+  if (f->flags & FD_LOCAL) {
+    int valid = local_fd_valid(f);
+    if (valid)
+      return valid < 0 ? -1 : local_read(f, buf, nbyte);
+  }
+
+  ssize_t ret;
+  if ((f->flags & FD_STRIPED) ||
+      (nstripes > 0 && (f->flags & FD_RDONLY) && nbyte >= STRIPE_MIN_READ &&
+       start_striping(f) == 0))
+    ret = striped_read(f, buf, nbyte);
+  else
+    ret = remote_read(f, buf, nbyte);
+  if (f->fill) {
+    int saved = errno;
+    lease_fill(f, buf, ret);
+    errno = saved;
+  }
+  return ret;
+}
 
+static ssize_t remote_read(struct remote_file *f, void *buf, size_t nbyte) {
   request r = {
       .header.opcode = READ,
-      .header.payload_len = sizeof(union req_union),
-      .req.read.fildes = fildes,
+      .req.read.fildes = f->sfd,
       .req.read.nbyte = nbyte,
   };
+  struct iovec req_iov[] = {{&r, sizeof(r)}};
 
-  response *res = malloc(MAXMSGLEN);
-  makerpc(&r, res);
+  // the payload after read_res.nbyte goes straight into the caller's buffer
+  response res;
+  struct iovec res_iov[] = {
+      {&res, offsetof(response, res.read.buf)},
+      {buf, nbyte},
+  };
+  makerpc(f->shard, req_iov, 1, res_iov, 2);
+
+  if (f->entry && res.res.read.nbyte > 0)
+    f->pos += res.res.read.nbyte;
+  errno = res.header.errno_value;
+  return res.res.read.nbyte;
+}
 
-  size_t read_size = res->res.read.nbyte;
-  memcpy(buf, res->res.read.buf, read_size);
-  errno = res->header.errno_value;
+// Looks up a block of the server's checksum window matching the `len` bytes
+// at `p`, whose weak checksum is `weak`. Returns the block index or -1.
+static long find_block(const block_sum *sums, const size_t *table, size_t mask,
+                       uint32_t weak, const unsigned char *p, size_t len) {
+  uint64_t strong = 0;
+  int have_strong = 0;
+  for (size_t h = (weak * 2654435761u) & mask; table[h]; h = (h + 1) & mask) {
+    const block_sum *b = &sums[table[h] - 1];
+    if (b->weak != weak)
+      continue;
+    if (!have_strong) {
+      strong = strong_sum(p, len);
+      have_strong = 1;
+    }
+    if (b->strong == strong)
+      return table[h] - 1;
+  }
+  return -1;
+}
+
+// Sends a write to open_fds[fd] as a delta against the blocks around its
+// current offset. Returns 0 with the write result in `ret_val`, or -1 if the
+// data should be sent with a plain WRITE instead.
+static int delta_write(int fd, const void *buf, size_t count,
+                       ssize_t *ret_val) {
+  struct remote_file *f = &open_fds[fd];
+  request r = {
+      .header.opcode = CHECKSUMS,
+      .req.checksums.fd = f->sfd,
+      .req.checksums.len = count,
+      .req.checksums.block_size = DELTA_BLOCK,
+  };
+  struct iovec req_iov[] = {{&r, sizeof(r)}};
+
+  size_t max_blocks = 3 * count / DELTA_BLOCK + 1;
+  size_t res_len = offsetof(response, res.checksums.sums) +
+                   max_blocks * WIRE_SIZE_block_sum;
+  response *res = malloc(res_len);
+  struct iovec res_iov[] = {{res, res_len}};
+  makerpc(f->shard, req_iov, 1, res_iov, 1);
+
+  checksums_res *cs = &res->res.checksums;
+  if (cs->ret_val < 0 || cs->nblocks == 0) {
+    // nothing to copy from; once past EOF a rewrite stays that way
+    if (cs->ret_val < 0 || cs->size <= cs->pos)
+      f->flags &= ~FD_DELTA;
+    free(res);
+    return -1;
+  }
+  size_t nblocks = cs->nblocks < max_blocks ? cs->nblocks : max_blocks;
+  block_sum *sums = malloc(nblocks * sizeof(block_sum));
+  const unsigned char *wsums = (unsigned char *)cs->sums;
+  for (size_t i = 0; i < nblocks; i++)
+    wsums = wire_block_sum_decode(wsums, &sums[i]);
+
+  size_t mask = 1;
+  while (mask < 2 * nblocks)
+    mask <<= 1;
+  size_t *table = calloc(mask, sizeof(size_t));
+  mask--;
+  for (size_t i = 0; i < nblocks; i++) {
+    size_t h = (sums[i].weak * 2654435761u) & mask;
+    while (table[h])
+      h = (h + 1) & mask;
+    table[h] = i + 1;
+  }
+
+  const unsigned char *p = buf;
+  delta_op *ops = malloc((2 * (count / DELTA_BLOCK) + 1) * sizeof(delta_op));
+  char *literal = malloc(count);
+  size_t nops = 0, literal_len = 0, literal_start = 0, i = 0;
+  uint32_t weak = 0;
+  int rolling = 0;
+  while (i + DELTA_BLOCK <= count) {
+    if (!rolling) {
+      weak = weak_sum(p + i, DELTA_BLOCK);
+      rolling = 1;
+    }
+    long b = find_block(sums, table, mask, weak, p + i, DELTA_BLOCK);
+    if (b < 0) {
+      if (i + DELTA_BLOCK < count)
+        weak = weak_roll(weak, DELTA_BLOCK, p[i], p[i + DELTA_BLOCK]);
+      i++;
+      continue;
+    }
+
+    if (i > literal_start) {
+      ops[nops++] = (delta_op){-1, i - literal_start, 0};
+      memcpy(literal + literal_len, p + literal_start, i - literal_start);
+      literal_len += i - literal_start;
+    }
+    off_t src = cs->start + b * DELTA_BLOCK;
+    // the server checks the sum of the blocks the client matched, which
+    // catches a change to the file since CHECKSUMS
+    if (nops > 0 && ops[nops - 1].src >= 0 &&
+        ops[nops - 1].src + (off_t)ops[nops - 1].len == src) {
+      ops[nops - 1].len += DELTA_BLOCK;
+      ops[nops - 1].strong =
+          strong_run_add(ops[nops - 1].strong, sums[b].strong);
+    } else {
+      ops[nops++] = (delta_op){src, DELTA_BLOCK,
+                               strong_run_add(STRONG_RUN_INIT, sums[b].strong)};
+    }
+    i += DELTA_BLOCK;
+    literal_start = i;
+    rolling = 0;
+  }
+  if (count > literal_start) {
+    ops[nops++] = (delta_op){-1, count - literal_start, 0};
+    memcpy(literal + literal_len, p + literal_start, count - literal_start);
+    literal_len += count - literal_start;
+  }
+  free(table);
+  free(sums);
   free(res);
-  return read_size;
+
+  int rv = -1;
+  if (nops * WIRE_SIZE_delta_op + literal_len < count) {
+    fprintf(stderr,
+            "[mylib.c]: delta write of %lu bytes: %lu ops, %lu literal\n",
+            count, nops, literal_len);
+    request d = {
+        .header.opcode = DELTA,
+        .req.delta.fd = f->sfd,
+        .req.delta.nops = nops,
+        .req.delta.literal_len = literal_len,
+        .req.delta.block_size = DELTA_BLOCK,
+    };
+    unsigned char *wops = malloc(nops * WIRE_SIZE_delta_op);
+    unsigned char *end = wops;
+    for (size_t k = 0; k < nops; k++)
+      end = wire_delta_op_encode(end, &ops[k]);
+    struct iovec delta_iov[] = {
+        {&d, offsetof(request, req.delta.buf)},
+        {wops, end - wops},
+        {literal, literal_len},
+    };
+    response delta_res;
+    struct iovec delta_res_iov[] = {{&delta_res, sizeof(delta_res)}};
+    makerpc(f->shard, delta_iov, 3, delta_res_iov, 1);
+    free(wops);
+
+    if (delta_res.res.write.ret_val >= 0) {
+      errno = delta_res.header.errno_value;
+      *ret_val = delta_res.res.write.ret_val;
+      rv = 0;
+    }
+  }
+  free(ops);
+  free(literal);
+  return rv;
 }
 
-ssize_t write(int fd, const void *buf, size_t count) {
+static ssize_t do_write(int fd, const void *buf, size_t count) {
 
   fprintf(stderr, "[mylib.c]: write called for fd %d, size: %lu \n", fd, count);
 
@@ -218,31 +1794,57 @@ ssize_t write(int fd, const void *buf, size_t count) {
   }
   fd -= REMOTE_FD;
 
-  int len = sizeof(request) + count;
-  request *r = malloc(len);
+  // the server receives a request into a MAXMSGLEN buffer, so larger writes
+  // are reported as short writes
+  if (count > MAXMSGLEN - offsetof(request, req.write.buf))
+    count = MAXMSGLEN - offsetof(request, req.write.buf);
 
-  r->header.opcode = WRITE;
-  r->header.payload_len = sizeof(union req_union) + count;
+  struct remote_file *f = &open_fds[fd];
+  if (f->flags & FD_LOCAL) {
+    errno = EBADF;
+    return -1;
+  }
+  if (f->entry) {
+    leases_poll();
+    if (!lease_valid(f->entry)) {
+      attr_entry_unref(f->entry);
+      f->entry = NULL;
+    }
+  }
+  ssize_t ret_val;
+  if (!f->entry)
+    attr_cache_drop(f->path);
+  if ((f->flags & FD_DELTA) && count >= DELTA_MIN_WRITE &&
+      delta_write(fd, buf, count, &ret_val) == 0) {
+    if (f->entry)
+      lease_wrote(f, buf, ret_val);
+    return ret_val;
+  }
 
-  r->req.write.count = count;
-  r->req.write.fd = fd;
-  memcpy(r->req.write.buf, buf, count);
+  request r = {
+      .header.opcode = WRITE,
+      .req.write.fd = f->sfd,
+      .req.write.count = count,
+  };
+  struct iovec req_iov[] = {
+      {&r, offsetof(request, req.write.buf)},
+      {(void *)buf, count},
+  };
 
-  response *res = malloc(MAXMSGLEN);
-  makerpc(r, res);
+  response res;
+  struct iovec res_iov[] = {{&res, sizeof(res)}};
+  makerpc(f->shard, req_iov, 2, res_iov, 1);
 
   fprintf(stderr, "[mylib.c]: rpc write return val: %lu, errno: %d\n",
-          res->res.write.ret_val, res->header.errno_value);
-
-  free(r);
+          res.res.write.ret_val, res.header.errno_value);
 
-  errno = res->header.errno_value;
-  int ret_val = res->res.write.ret_val;
-  free(res);
-  return ret_val;
+  if (f->entry)
+    lease_wrote(f, buf, res.res.write.ret_val);
+  errno = res.header.errno_value;
+  return res.res.write.ret_val;
 }
 
-int close(int fildes) {
+static int do_close(int fildes) {
 
   if (!remote_fd(fildes)) {
     return orig_close(fildes);
@@ -250,101 +1852,335 @@ int close(int fildes) {
   fildes -= REMOTE_FD;
 
   fprintf(stderr, "[mylib.c]: close called for fildes %d\n", fildes);
-  request r = {.header.opcode = CLOSE,
-               .header.payload_len = sizeof(union req_union),
-               .req.close.fd = fildes};
+  struct remote_file *f = &open_fds[fildes];
+  if (f->flags & FD_LOCAL) {
+    free_remote_fd(fildes);
+    return 0;
+  }
+  if (f->flags & FD_STRIPED)
+    stop_striping(f);
+  // a write delegation nobody writes through any more would only hold up
+  // other clients until we next talk to the server
+  if (f->entry && f->entry->mode == LEASE_WRITE && f->entry->refs <= 2 &&
+      f->entry->lease)
+    lease_release(f->shard, f->entry->lease);
+  request r = {.header.opcode = CLOSE, .req.close.fd = f->sfd};
+  struct iovec req_iov[] = {{&r, sizeof(r)}};
 
   response res;
-  makerpc(&r, &res);
+  struct iovec res_iov[] = {{&res, sizeof(res)}};
+  makerpc(f->shard, req_iov, 1, res_iov, 1);
 
   errno = res.header.errno_value;
-  open_fds[fildes] = 0;
+  free_remote_fd(fildes);
   return res.res.close.ret_val;
 }
 
-int stat(const char *restrict pathname, struct stat *restrict statbuf) {
+static int do_stat(const char *restrict pathname,
+                   struct stat *restrict statbuf) {
   fprintf(stderr, "[mylib.c]: stat called for file: %s\n", pathname);
+  if (!remote_path(pathname))
+    return orig_stat(pathname, statbuf);
+
+  int cached = attr_cache_get(pathname, statbuf);
+  if (cached == 0)
+    return 0;
+  if (cached == ENOENT) {
+    errno = ENOENT;
+    return -1;
+  }
 
-  int pathname_len = strlen(pathname) + 1;
-  int len = sizeof(request) + pathname_len;
-  request *r = malloc(len);
+  int shard = shard_for(pathname);
+  if (leases_on) {
+    response res;
+    long sent = now_ns();
+    lease_send(shard, pathname, LEASE_READ);
+    lease_recv(shard, pathname, sent, &res);
+    errno = res.header.errno_value;
+    memcpy(statbuf, &res.res.lease.statbuf, sizeof(struct stat));
+    return res.res.lease.ret_val;
+  }
 
-  r->header.opcode = STAT;
-  r->header.payload_len = sizeof(union req_union) + pathname_len;
-  memcpy(r->req.stat.pathname, pathname, pathname_len);
+  request r = {.header.opcode = STAT};
+  struct iovec req_iov[] = {
+      {&r, offsetof(request, req.stat.pathname)},
+      {(void *)pathname, strlen(pathname) + 1},
+  };
 
   response res;
-  makerpc(r, &res);
+  struct iovec res_iov[] = {{&res, sizeof(res)}};
+  makerpc(shard, req_iov, 2, res_iov, 1);
 
   errno = res.header.errno_value;
+  if (res.res.stat.ret_val == -1 && errno == ENOENT)
+    neg_cache_put(pathname);
   memcpy(statbuf, &res.res.stat.statbuf, sizeof(struct stat));
-  free(r);
   return res.res.stat.ret_val;
 }
 
-off_t lseek(int fd, off_t offset, int whence) {
+static off_t do_lseek(int fd, off_t offset, int whence) {
 
   fprintf(stderr, "[mylib.c]: lseek called for fildes %d\n", fd);
   if (!remote_fd(fd)) {
     return orig_lseek(fd, offset, whence);
   }
-  fd -= REMOTE_FD;
+  struct remote_file *f = &open_fds[fd - REMOTE_FD];
+
+  // local fds only need the file for SEEK_END
+  if ((f->flags & FD_LOCAL) && whence == SEEK_END &&
+      local_fd_valid(f) < 0)
+    return -1;
+  if (f->flags & FD_LOCAL) {
+    off_t pos = offset;
+    if (whence == SEEK_CUR)
+      pos += f->pos;
+    else if (whence == SEEK_END)
+      pos += f->entry->statbuf.st_size;
+    if (pos < 0 ||
+        (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END)) {
+      errno = EINVAL;
+      return -1;
+    }
+    return f->pos = pos;
+  }
+
+  // the server's directory offset is past the buffered page
+  struct dir_page *pg = f->dir;
+  if (pg) {
+    if (whence == SEEK_CUR) {
+      offset += pg->pos;
+      whence = SEEK_SET;
+    }
+    free_dir_page(f);
+  }
+
+  // striped files keep their offset here; the server is only needed to
+  // look at the file, e.g. to find its end
+  if ((f->flags & FD_STRIPED) && (whence == SEEK_SET || whence == SEEK_CUR)) {
+    off_t pos = whence == SEEK_CUR ? f->pos + offset : offset;
+    if (pos < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    f->pos = pos;
+    if (f->fill && f->fill_len != (size_t)pos)
+      lease_fill(f, NULL, -1);
+    return pos;
+  }
+
   request r = {
       .header.opcode = LSEEK,
-      .header.payload_len = sizeof(union req_union),
 
-      .req.lseek.fd = fd,
+      .req.lseek.fd = f->sfd,
       .req.lseek.offset = offset,
       .req.lseek.whence = whence,
   };
+  struct iovec req_iov[] = {{&r, sizeof(r)}};
 
   response res;
-  makerpc(&r, &res);
+  struct iovec res_iov[] = {{&res, sizeof(res)}};
+  makerpc(f->shard, req_iov, 1, res_iov, 1);
 
   errno = res.header.errno_value;
+  if ((f->flags & FD_STRIPED || f->entry) && res.res.lseek.off >= 0)
+    f->pos = res.res.lseek.off;
+  // collecting the content only works while reads are sequential
+  if (f->fill && (size_t)f->pos != f->fill_len)
+    lease_fill(f, NULL, -1);
   return res.res.lseek.off;
 }
 
-int unlink(const char *pathname) {
-  int pathname_len = strlen(pathname) + 1;
-  int len = sizeof(request) + pathname_len;
-  request *r = malloc(len);
+static int do_unlink(const char *pathname) {
+  if (!remote_path(pathname))
+    return orig_unlink(pathname);
+  attr_cache_drop(pathname);
 
-  r->header.opcode = UNLINK;
-  r->header.payload_len = sizeof(union req_union) + pathname_len;
-  memcpy(r->req.unlink.pathname, pathname, pathname_len);
+  request r = {.header.opcode = UNLINK};
+  struct iovec req_iov[] = {
+      {&r, offsetof(request, req.unlink.pathname)},
+      {(void *)pathname, strlen(pathname) + 1},
+  };
 
   response res;
-  makerpc(r, &res);
+  struct iovec res_iov[] = {{&res, sizeof(res)}};
+  makerpc(shard_for(pathname), req_iov, 2, res_iov, 1);
 
   errno = res.header.errno_value;
-  free(r);
   return res.res.unlink.ret_val;
 }
 
-ssize_t getdirentries(int fd, char *buf, size_t nbytes, off_t *restrict basep) {
-  fprintf(stderr, "[mylib.c]: getdirentries called for fildes %d\n", fd);
+// Fetches the next page of entries of directory open_fds[fd] with their
+// attributes, caching the attributes under the directory's path.
+// open() sent a directory to the shard of its parent, which holds its name
+// but not its entries. Moves `f` to a descriptor for the same directory on
+// the shard that holds them, before anything is listed.
+static int follow_dir_shard(struct remote_file *f) {
+  int shard = dir_shard(f->path);
+  if (shard == f->shard)
+    return 0;
+  request r = {
+      .header.opcode = OPEN,
+      .req.open.flags = O_RDONLY | O_DIRECTORY,
+  };
+  struct iovec req_iov[] = {
+      {&r, offsetof(request, req.open.pathname)},
+      {f->path, strlen(f->path) + 1},
+  };
+  response res;
+  struct iovec res_iov[] = {{&res, sizeof(res)}};
+  makerpc(shard, req_iov, 2, res_iov, 1);
+  if (res.res.open.ret_val < 0) {
+    errno = res.header.errno_value;
+    return -1;
+  }
 
-  fd -= REMOTE_FD;
+  int sfd = res.res.open.ret_val;
+  request c = {.header.opcode = CLOSE, .req.close.fd = f->sfd};
+  struct iovec close_iov[] = {{&c, sizeof(c)}};
+  makerpc(f->shard, close_iov, 1, res_iov, 1);
+  f->shard = shard;
+  f->sfd = sfd;
+  return 0;
+}
+
+// Rebuilds struct dirent records from `len` bytes of dirent_rec entries.
+// Returns them, with their length in *host_len.
+static char *rebuild_dirents(const unsigned char *recs, size_t len,
+                             size_t *host_len) {
+  const unsigned char *p, *end = recs + len;
+  dirent_rec rec;
+  size_t n = 0;
+  for (p = recs; p < end; p += rec.name_len) {
+    if ((size_t)(end - p) < WIRE_SIZE_dirent_rec)
+      errx(1, "[mylib.c]: malformed directory entries");
+    p = wire_dirent_rec_decode(p, &rec);
+    if (rec.name_len >= sizeof(((struct dirent *)0)->d_name) ||
+        (size_t)(end - p) < rec.name_len)
+      errx(1, "[mylib.c]: malformed directory entries");
+    n += (offsetof(struct dirent, d_name) + rec.name_len + 8) & ~(size_t)7;
+  }
 
+  char *out = malloc(n ? n : 1);
+  size_t off = 0;
+  for (p = recs; p < end; p += rec.name_len) {
+    p = wire_dirent_rec_decode(p, &rec);
+    struct dirent *d = (struct dirent *)(out + off);
+    size_t reclen =
+        (offsetof(struct dirent, d_name) + rec.name_len + 8) & ~(size_t)7;
+    memset(d, 0, reclen);
+    d->d_ino = rec.ino;
+    d->d_off = rec.off;
+    d->d_reclen = reclen;
+    d->d_type = rec.type;
+    memcpy(d->d_name, p, rec.name_len);
+    off += reclen;
+  }
+  *host_len = n;
+  return out;
+}
+
+static struct dir_page *fetch_dir_page(int fd) {
+  struct remote_file *f = &open_fds[fd];
+  if (f->path && follow_dir_shard(f) < 0)
+    return NULL;
   request req = {
-      .header.opcode = GETDIRENTRIES,
-      .header.payload_len = sizeof(union req_union),
-      .req.direntries.fd = fd,
-      .req.direntries.nbytes = nbytes,
+      .header.opcode = READDIRPLUS,
+      .req.direntries.fd = f->sfd,
+      .req.direntries.nbytes = DIR_PAGE_BYTES,
   };
+  struct iovec req_iov[] = {{&req, sizeof(req)}};
 
-  response *res = malloc(MAXMSGLEN);
-  makerpc(&req, res);
+  // every entry takes at least WIRE_SIZE_dirent_rec + 1 bytes and the
+  // attributes follow the entries
+  size_t max_attrs = DIR_PAGE_BYTES / (WIRE_SIZE_dirent_rec + 1);
+  size_t cap = DIR_PAGE_BYTES + max_attrs * WIRE_SIZE_entry_attr;
+  char *recs = malloc(cap);
+  response res;
+  struct iovec res_iov[] = {
+      {&res, offsetof(response, res.readdirplus.buf)},
+      {recs, cap},
+  };
+  makerpc(f->shard, req_iov, 1, res_iov, 2);
 
-  errno = res->header.errno_value;
-  ssize_t ret_val;
-  if ((ret_val = res->res.direntries.ret_val) > 0) {
-    memcpy(buf, res->res.direntries.buf, ret_val);
-    *basep = res->res.direntries.basep;
+  errno = res.header.errno_value;
+  ssize_t recs_len = res.res.readdirplus.ret_val;
+  if (recs_len <= 0) {
+    free(recs);
+    return recs_len < 0 ? NULL : calloc(1, sizeof(struct dir_page));
   }
-  free(res);
-  return ret_val;
+  if (recs_len > DIR_PAGE_BYTES || res.res.readdirplus.nattrs > max_attrs)
+    errx(1, "[mylib.c]: malformed READDIRPLUS response");
+  size_t len;
+  char *entries = rebuild_dirents((unsigned char *)recs, recs_len, &len);
+  const unsigned char *attrs = (unsigned char *)recs + recs_len;
+
+  const char *dir = f->path;
+  if (dir) {
+    size_t dir_len = strlen(dir);
+    int sep = dir_len > 0 && dir[dir_len - 1] != '/';
+    char path[dir_len + sizeof(((struct dirent *)0)->d_name) + 1];
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    size_t i = 0;
+    for (size_t off = 0; off < len && i < res.res.readdirplus.nattrs; i++) {
+      struct dirent *d = (struct dirent *)(entries + off);
+      entry_attr a;
+      attrs = wire_entry_attr_decode(attrs, &a);
+      if (a.ret_val == 0) {
+        strcpy(path + dir_len + sep, d->d_name);
+        attr_cache_put(path, &a.statbuf);
+      }
+      off += d->d_reclen;
+    }
+  }
+
+  free(recs);
+
+  struct dir_page *pg = malloc(sizeof(struct dir_page));
+  pg->len = len;
+  pg->next = 0;
+  pg->pos = res.res.readdirplus.basep;
+  pg->entries = entries;
+  return pg;
+}
+
+static ssize_t do_getdirentries(int fd, char *buf, size_t nbytes,
+                                off_t *restrict basep) {
+  fprintf(stderr, "[mylib.c]: getdirentries called for fildes %d\n", fd);
+
+  if (!remote_fd(fd)) {
+    return orig_getdirentries(fd, buf, nbytes, basep);
+  }
+  fd -= REMOTE_FD;
+
+  struct remote_file *f = &open_fds[fd];
+  if ((f->flags & FD_LOCAL) && promote_local_fd(f) < 0)
+    return -1;
+  if (f->dir == NULL || f->dir->next >= f->dir->len) {
+    free_dir_page(f);
+    if ((f->dir = fetch_dir_page(fd)) == NULL)
+      return -1;
+  }
+
+  // hand out whole records that fit in the caller's buffer
+  struct dir_page *pg = f->dir;
+  off_t base = pg->pos;
+  size_t n = 0;
+  while (pg->next + n < pg->len) {
+    struct dirent *d = (struct dirent *)(pg->entries + pg->next + n);
+    if (n + d->d_reclen > nbytes)
+      break;
+    pg->pos = d->d_off;
+    n += d->d_reclen;
+  }
+  if (n == 0 && pg->next < pg->len) {
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(buf, pg->entries + pg->next, n);
+  pg->next += n;
+  *basep = base;
+  return n;
 }
 
 struct dirtreenode *deserialize_to_dirtree(char *buf, size_t *nbyte) {
@@ -360,8 +2196,8 @@ struct dirtreenode *deserialize_to_dirtree(char *buf, size_t *nbyte) {
   memcpy(tree->name, offset, entryname_len);
   offset += entryname_len;
 
-  tree->num_subdirs = *(int *)offset;
-  offset += sizeof(int);
+  tree->num_subdirs = wire_get_u32((unsigned char *)offset);
+  offset += WIRE_SIZE_u32;
 
   tree->subdirs = malloc(tree->num_subdirs * sizeof(struct dirtreenode *));
   size_t n = 0;
@@ -375,24 +2211,229 @@ struct dirtreenode *deserialize_to_dirtree(char *buf, size_t *nbyte) {
   return tree;
 }
 
-struct dirtreenode *getdirtree(const char *path) {
-  fprintf(stderr, "[mylib.c]: getdirtree called for file: %s\n", path);
+// Adds the subdirectories of `from` missing in `into` and frees `from`.
+static struct dirtreenode *merge_dirtree(struct dirtreenode *into,
+                                         struct dirtreenode *from) {
+  for (int i = 0; i < from->num_subdirs; i++) {
+    struct dirtreenode *sub = from->subdirs[i];
+    int j = 0;
+    while (j < into->num_subdirs && strcmp(into->subdirs[j]->name, sub->name))
+      j++;
+    if (j < into->num_subdirs) {
+      merge_dirtree(into->subdirs[j], sub);
+      continue;
+    }
+    into->subdirs = realloc(into->subdirs, (into->num_subdirs + 1) *
+                                               sizeof(struct dirtreenode *));
+    into->subdirs[into->num_subdirs++] = sub;
+  }
+  free(from->name);
+  free(from->subdirs);
+  free(from);
+  return into;
+}
 
-  int path_len = strlen(path) + 1;
-  int len = sizeof(request) + path_len;
-  request *r = malloc(len);
+static struct dirtreenode *do_getdirtree(const char *path) {
+  fprintf(stderr, "[mylib.c]: getdirtree called for file: %s\n", path);
+  if (!remote_path(path))
+    return orig_getdirtree(path);
 
-  r->header.opcode = GETDIRTREE;
-  r->header.payload_len = sizeof(union req_union) + path_len;
-  memcpy(r->req.dirtree.path, path, path_len);
+  request r = {.header.opcode = GETDIRTREE};
+  struct iovec req_iov[] = {
+      {&r, offsetof(request, req.dirtree.path)},
+      {(void *)path, strlen(path) + 1},
+  };
 
+  // subdirectories keep their entries on different shards, so every shard
+  // contributes the part of the tree it has
+  if (!client_ready)
+    initialize_client();
   response *res = malloc(MAXMSGLEN);
-  makerpc(r, res);
-
-  errno = res->header.errno_value;
-  struct dirtreenode *tree = deserialize_to_dirtree(res->res.dirtree.buf, NULL);
-  free(r);
+  struct iovec res_iov[] = {{res, MAXMSGLEN}};
+  struct dirtreenode *tree = NULL;
+  int err = 0;
+  for (int i = 0; i < nshards; i++) {
+    makerpc(i, req_iov, 2, res_iov, 1);
+    if (res->header.payload_len == 0) {
+      err = res->header.errno_value;
+      continue;
+    }
+    struct dirtreenode *t = deserialize_to_dirtree(res->res.dirtree.buf, NULL);
+    tree = tree ? merge_dirtree(tree, t) : t;
+  }
   free(res);
+  errno = tree ? 0 : err;
+  return tree;
+}
+
+// Tracing: with trace15440 set, every call that goes to a server is appended
+// to <trace15440>.<pid> as a trace_record plus its path (see trace.h).
+// Records are buffered and written out when the buffer fills and at exit.
+#define TRACE_BUF 65536
+
+int trace_fd = -1;
+pid_t trace_pid;
+size_t trace_len = 0;
+unsigned char trace_buf[TRACE_BUF];
+
+static void trace_flush() {
+  size_t off = 0;
+  while (off < trace_len) {
+    ssize_t n = orig_write(trace_fd, trace_buf + off, trace_len - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      fprintf(stderr, "[mylib.c]: trace write failed, tracing stopped\n");
+      orig_close(trace_fd);
+      trace_fd = -1;
+      break;
+    }
+    off += n;
+  }
+  trace_len = 0;
+}
+
+static void trace_open() {
+  const char *name = getenv("trace15440");
+  if (!name || !*name)
+    return;
+  char path[PATH_MAX];
+  trace_pid = getpid();
+  snprintf(path, sizeof(path), "%s.%d", name, (int)trace_pid);
+  trace_fd = orig_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace_fd < 0) {
+    fprintf(stderr, "[mylib.c]: cannot open trace %s: %s\n", path,
+            strerror(errno));
+    return;
+  }
+  memcpy(trace_buf, TRACE_MAGIC, TRACE_MAGIC_LEN);
+  trace_len = TRACE_MAGIC_LEN;
+}
+
+static void trace_call(int opcode, long start, int fd, long arg, int aux,
+                       long ret, const char *path) {
+  int saved_errno = errno;
+  if (getpid() != trace_pid) {
+    // forked child: the buffered records are the parent's to write
+    orig_close(trace_fd);
+    trace_fd = -1;
+    trace_len = 0;
+    trace_open();
+    if (trace_fd < 0)
+      goto out;
+  }
+  size_t path_len = path ? strnlen(path, UINT16_MAX) : 0;
+  if (trace_len + TRACE_RECORD_SIZE + path_len > TRACE_BUF)
+    trace_flush();
+  if (trace_fd < 0)
+    goto out;
+
+  long end = now_ns();
+  struct trace_record rec = {
+      .start = start / 1000,
+      .duration = (end - start) / 1000,
+      .opcode = opcode,
+      .aux = aux,
+      .path_len = path_len,
+      .fd = fd,
+      .arg = arg,
+      .ret = ret,
+  };
+  wire_trace_record_encode(trace_buf + trace_len, &rec);
+  memcpy(trace_buf + trace_len + TRACE_RECORD_SIZE, path, path_len);
+  trace_len += TRACE_RECORD_SIZE + path_len;
+out:
+  errno = saved_errno;
+}
+
+// The interposed functions: the do_*() implementations, traced when they go
+// to a server.
+
+int open(const char *pathname, int flags, ...) {
+  mode_t m = 0;
+  if (flags & O_CREAT) {
+    va_list a;
+    va_start(a, flags);
+    m = va_arg(a, mode_t);
+    va_end(a);
+  }
+  if (trace_fd < 0 || !remote_path(pathname))
+    return do_open(pathname, flags, m);
+  long start = now_ns();
+  int ret = do_open(pathname, flags, m);
+  trace_call(OPEN, start, -1, flags, 0, ret, pathname);
+  return ret;
+}
+
+ssize_t read(int fildes, void *buf, size_t nbyte) {
+  if (trace_fd < 0 || !remote_fd(fildes))
+    return do_read(fildes, buf, nbyte);
+  long start = now_ns();
+  ssize_t ret = do_read(fildes, buf, nbyte);
+  trace_call(READ, start, fildes, nbyte, 0, ret, NULL);
+  return ret;
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+  if (trace_fd < 0 || !remote_fd(fd))
+    return do_write(fd, buf, count);
+  long start = now_ns();
+  ssize_t ret = do_write(fd, buf, count);
+  trace_call(WRITE, start, fd, count, 0, ret, NULL);
+  return ret;
+}
+
+int close(int fildes) {
+  if (trace_fd < 0 || !remote_fd(fildes))
+    return do_close(fildes);
+  long start = now_ns();
+  int ret = do_close(fildes);
+  trace_call(CLOSE, start, fildes, 0, 0, ret, NULL);
+  return ret;
+}
+
+int stat(const char *restrict pathname, struct stat *restrict statbuf) {
+  if (trace_fd < 0 || !remote_path(pathname))
+    return do_stat(pathname, statbuf);
+  long start = now_ns();
+  int ret = do_stat(pathname, statbuf);
+  trace_call(STAT, start, -1, 0, 0, ret, pathname);
+  return ret;
+}
+
+off_t lseek(int fd, off_t offset, int whence) {
+  if (trace_fd < 0 || !remote_fd(fd))
+    return do_lseek(fd, offset, whence);
+  long start = now_ns();
+  off_t ret = do_lseek(fd, offset, whence);
+  trace_call(LSEEK, start, fd, offset, whence, ret, NULL);
+  return ret;
+}
+
+int unlink(const char *pathname) {
+  if (trace_fd < 0 || !remote_path(pathname))
+    return do_unlink(pathname);
+  long start = now_ns();
+  int ret = do_unlink(pathname);
+  trace_call(UNLINK, start, -1, 0, 0, ret, pathname);
+  return ret;
+}
+
+ssize_t getdirentries(int fd, char *buf, size_t nbytes, off_t *restrict basep) {
+  if (trace_fd < 0 || !remote_fd(fd))
+    return do_getdirentries(fd, buf, nbytes, basep);
+  long start = now_ns();
+  ssize_t ret = do_getdirentries(fd, buf, nbytes, basep);
+  trace_call(GETDIRENTRIES, start, fd, nbytes, 0, ret, NULL);
+  return ret;
+}
+
+struct dirtreenode *getdirtree(const char *path) {
+  if (trace_fd < 0 || !remote_path(path))
+    return do_getdirtree(path);
+  long start = now_ns();
+  struct dirtreenode *tree = do_getdirtree(path);
+  trace_call(GETDIRTREE, start, -1, 0, 0, tree ? 0 : -1, path);
   return tree;
 }
 
@@ -429,5 +2470,12 @@ void _init(void) {
   orig_freedirtree = dlsym(RTLD_NEXT, "freedirtree");
   fprintf(stderr, "[mylib.c] Init mylib\n");
 
-  initialize_client();
+  initialize_mounts();
+  trace_open();
+}
+
+// Called at exit and when the library is unloaded
+void _fini(void) {
+  if (trace_fd >= 0 && getpid() == trace_pid)
+    trace_flush();
 }
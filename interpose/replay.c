@@ -0,0 +1,369 @@
+/**
+ * @file replay.c
+ * @brief Load generator that replays call traces recorded by `mylib.so`.
+ *
+ * Usage: `replay [-c clients] [-s speedup] trace...`
+ *
+ * Each of the virtual clients replays one of the trace files (client i gets
+ * trace i modulo the number of traces) on its own connection to the server
+ * named by `server15440`/`serverport15440`, all driven from one event loop
+ * with `librfs`.
+ *
+ * Features:
+ * - **Timing**: A call is issued when its recorded start time, relative to
+ * the start of its trace and divided by the speedup, has passed. Like the
+ * traced program, a client has one call outstanding at a time, so a slow
+ * server delays the rest of its trace. With `-s 0`, calls are issued as
+ * soon as the previous one completes.
+ * - **File Descriptors**: fds returned by replayed OPENs stand in for the
+ * traced ones; calls on fds whose OPEN failed are skipped.
+ * - **Report**: Throughput in calls and bytes per second, and latency
+ * percentiles per operation.
+ *
+ * `getdirentries()` calls are skipped, since `librfs` does not offer them,
+ * and READ/WRITE sizes are capped at SCRATCH_LEN.
+ *
+ * Replayed calls really happen on the server: WRITEs write zeros into the
+ * traced files and UNLINKs remove them, so replay against a scratch copy of
+ * the data, never against files that matter.
+ */
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "message.h"
+#include "rfs.h"
+#include "trace.h"
+
+#define SCRATCH_LEN (1024 * 1024)
+#define MAX_CLIENTS 1024
+#define MAX_FDS 256
+#define NOPCODES (PREAD + 1)
+
+static const char *op_names[NOPCODES] = {
+    [OPEN] = "open",       [READ] = "read",
+    [WRITE] = "write",     [CLOSE] = "close",
+    [LSEEK] = "lseek",     [STAT] = "stat",
+    [UNLINK] = "unlink",   [GETDIRENTRIES] = "getdirentries",
+    [GETDIRTREE] = "getdirtree",
+};
+
+struct call {
+  struct trace_record rec;
+  char *path; // NUL-terminated, or NULL
+};
+
+struct trace {
+  const char *name;
+  struct call *calls;
+  size_t ncalls;
+};
+
+// A traced fd and the fd its OPEN got on the server
+struct fd_pair {
+  int traced;
+  int sfd;
+};
+
+struct vclient {
+  rfs_client *c;
+  struct trace *t;
+  size_t next;  // index of the next call to issue
+  int busy;     // a call is outstanding
+  long issued;  // when the outstanding call was submitted
+  const struct call *call;
+  struct stat statbuf;
+  struct fd_pair fds[MAX_FDS];
+  int nfds;
+};
+
+// Latencies of completed calls of one opcode, in nanoseconds
+struct latencies {
+  long *ns;
+  size_t len, cap;
+};
+
+struct latencies lat[NOPCODES];
+long bytes = 0;   // moved by READ and WRITE
+long skipped = 0; // calls not replayed
+char *scratch;
+
+static long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void load_trace(struct trace *t, const char *name) {
+  FILE *f = fopen(name, "r");
+  if (!f)
+    err(1, "%s", name);
+  char magic[TRACE_MAGIC_LEN];
+  if (fread(magic, 1, TRACE_MAGIC_LEN, f) != TRACE_MAGIC_LEN ||
+      memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN))
+    errx(1, "%s: not a trace file", name);
+
+  size_t cap = 0;
+  unsigned char buf[TRACE_RECORD_SIZE];
+  t->name = name;
+  t->calls = NULL;
+  t->ncalls = 0;
+  while (fread(buf, 1, TRACE_RECORD_SIZE, f) == TRACE_RECORD_SIZE) {
+    if (t->ncalls == cap) {
+      cap = cap ? 2 * cap : 1024;
+      t->calls = realloc(t->calls, cap * sizeof(*t->calls));
+      if (!t->calls)
+        err(1, 0);
+    }
+    struct call *c = &t->calls[t->ncalls];
+    wire_trace_record_decode(buf, &c->rec);
+    if (c->rec.opcode >= NOPCODES)
+      errx(1, "%s: bad record %zu", name, t->ncalls);
+    c->path = NULL;
+    if (c->rec.path_len) {
+      c->path = malloc(c->rec.path_len + 1);
+      if (!c->path)
+        err(1, 0);
+      if (fread(c->path, 1, c->rec.path_len, f) != c->rec.path_len) {
+        free(c->path); // truncated at the last record, e.g. the program crashed
+        break;
+      }
+      c->path[c->rec.path_len] = '\0';
+    }
+    t->ncalls++;
+  }
+  fclose(f);
+}
+
+static struct fd_pair *find_fd(struct vclient *vc, int traced) {
+  for (int i = 0; i < vc->nfds; i++)
+    if (vc->fds[i].traced == traced)
+      return &vc->fds[i];
+  return NULL;
+}
+
+static void add_latency(int opcode, long ns) {
+  struct latencies *l = &lat[opcode];
+  if (l->len == l->cap) {
+    l->cap = l->cap ? 2 * l->cap : 1024;
+    l->ns = realloc(l->ns, l->cap * sizeof(long));
+    if (!l->ns)
+      err(1, 0);
+  }
+  l->ns[l->len++] = ns;
+}
+
+static void completed(const rfs_result *res) {
+  struct vclient *vc = res->arg;
+  const struct trace_record *rec = &vc->call->rec;
+  add_latency(rec->opcode, now_ns() - vc->issued);
+  vc->busy = 0;
+
+  switch (res->opcode) {
+  case OPEN:
+    // map the traced fd; it may be reused after a CLOSE we never saw
+    if (res->ret >= 0 && rec->ret >= 0) {
+      struct fd_pair *p = find_fd(vc, rec->ret);
+      if (!p && vc->nfds < MAX_FDS)
+        p = &vc->fds[vc->nfds++];
+      if (p)
+        *p = (struct fd_pair){rec->ret, res->ret};
+    }
+    break;
+  case READ:
+  case WRITE:
+    if (res->ret > 0)
+      bytes += res->ret;
+    break;
+  case GETDIRTREE:
+    rfs_freedirtree(res->tree);
+    break;
+  }
+}
+
+// Submit the next call of vc, or skip it; returns 0 if it was skipped.
+static int issue(struct vclient *vc) {
+  const struct call *call = &vc->t->calls[vc->next++];
+  const struct trace_record *rec = &call->rec;
+  size_t len = rec->arg < SCRATCH_LEN ? rec->arg : SCRATCH_LEN;
+  struct fd_pair *p = NULL;
+  int rv = -1;
+
+  if (rec->fd >= 0) {
+    p = find_fd(vc, rec->fd);
+    if (!p) {
+      skipped++;
+      return 0;
+    }
+  }
+  vc->call = call;
+  vc->issued = now_ns();
+  switch (rec->opcode) {
+  case OPEN:
+    rv = rfs_open(vc->c, call->path, rec->arg, 0644, completed, vc);
+    break;
+  case READ:
+    rv = rfs_read(vc->c, p->sfd, scratch, len, completed, vc);
+    break;
+  case WRITE:
+    rv = rfs_write(vc->c, p->sfd, scratch, len, completed, vc);
+    break;
+  case CLOSE:
+    rv = rfs_close(vc->c, p->sfd, completed, vc);
+    *p = vc->fds[--vc->nfds];
+    break;
+  case LSEEK:
+    rv = rfs_lseek(vc->c, p->sfd, rec->arg, rec->aux, completed, vc);
+    break;
+  case STAT:
+    rv = rfs_stat(vc->c, call->path, &vc->statbuf, completed, vc);
+    break;
+  case UNLINK:
+    rv = rfs_unlink(vc->c, call->path, completed, vc);
+    break;
+  case GETDIRTREE:
+    rv = rfs_getdirtree(vc->c, call->path, completed, vc);
+    break;
+  }
+  if (rv < 0) {
+    skipped++;
+    return 0;
+  }
+  vc->busy = 1;
+  return 1;
+}
+
+static int cmp_long(const void *a, const void *b) {
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile_us(const struct latencies *l, double q) {
+  size_t i = q * (l->len - 1);
+  return l->ns[i] / 1000.0;
+}
+
+static void report(long elapsed) {
+  long calls = 0;
+  for (int op = 0; op < NOPCODES; op++)
+    calls += lat[op].len;
+  double secs = elapsed / 1e9;
+  printf("%ld calls in %.3f s: %.0f calls/s, %.2f MB/s", calls, secs,
+         calls / secs, bytes / secs / (1024 * 1024));
+  if (skipped)
+    printf(", %ld skipped", skipped);
+  printf("\n\n%-14s %10s %10s %10s %10s %10s\n", "latency (us)", "count",
+         "p50", "p90", "p99", "max");
+  for (int op = 0; op < NOPCODES; op++) {
+    struct latencies *l = &lat[op];
+    if (!l->len)
+      continue;
+    qsort(l->ns, l->len, sizeof(long), cmp_long);
+    printf("%-14s %10zu %10.1f %10.1f %10.1f %10.1f\n", op_names[op], l->len,
+           percentile_us(l, 0.5), percentile_us(l, 0.9),
+           percentile_us(l, 0.99), l->ns[l->len - 1] / 1000.0);
+  }
+}
+
+static void usage() {
+  errx(2, "usage: replay [-c clients] [-s speedup] trace...\n"
+          "replayed WRITEs and UNLINKs modify the traced files on the server; "
+          "use a scratch copy of the data");
+}
+
+int main(int argc, char **argv) {
+  int nclients = 1;
+  double speed = 1.0;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:s:")) != -1) {
+    switch (opt) {
+    case 'c':
+      nclients = atoi(optarg);
+      break;
+    case 's':
+      speed = atof(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind == argc || nclients < 1 || nclients > MAX_CLIENTS || speed < 0)
+    usage();
+
+  int ntraces = argc - optind;
+  struct trace *traces = calloc(ntraces, sizeof(struct trace));
+  scratch = calloc(1, SCRATCH_LEN);
+  if (!traces || !scratch)
+    err(1, 0);
+  for (int i = 0; i < ntraces; i++)
+    load_trace(&traces[i], argv[optind + i]);
+
+  char *serverip = getenv("server15440");
+  char *serverport = getenv("serverport15440");
+  if (!serverip)
+    serverip = "127.0.0.1";
+  unsigned short port = serverport ? atoi(serverport) : 15440;
+
+  struct vclient *vcs = calloc(nclients, sizeof(struct vclient));
+  struct pollfd *pfds = calloc(nclients, sizeof(struct pollfd));
+  if (!vcs || !pfds)
+    err(1, 0);
+  for (int i = 0; i < nclients; i++) {
+    vcs[i].t = &traces[i % ntraces];
+    vcs[i].c = rfs_connect(serverip, port);
+    if (!vcs[i].c)
+      err(1, "connect %s:%u", serverip, port);
+  }
+
+  long base = now_ns();
+  int active = nclients;
+  while (active) {
+    // issue every call that is due, and find when the next one will be
+    long now = now_ns();
+    long wake = -1;
+    active = 0;
+    for (int i = 0; i < nclients; i++) {
+      struct vclient *vc = &vcs[i];
+      while (!vc->busy && vc->next < vc->t->ncalls) {
+        long due = now;
+        if (speed > 0)
+          due = base + (vc->t->calls[vc->next].rec.start -
+                        vc->t->calls[0].rec.start) *
+                           1000 / speed;
+        if (due > now) {
+          if (wake < 0 || due < wake)
+            wake = due;
+          break;
+        }
+        issue(vc);
+      }
+      if (vc->busy || vc->next < vc->t->ncalls)
+        active++;
+      pfds[i].fd = rfs_socket(vc->c);
+      pfds[i].events = rfs_events(vc->c);
+    }
+    if (!active)
+      break;
+
+    int timeout = -1;
+    if (wake >= 0)
+      timeout = (wake - now + 999999) / 1000000;
+    if (poll(pfds, nclients, timeout) < 0)
+      err(1, "poll");
+    for (int i = 0; i < nclients; i++)
+      if (pfds[i].revents && rfs_process(vcs[i].c) < 0)
+        errx(1, "client %d: server closed the connection", i);
+  }
+  report(now_ns() - base);
+
+  for (int i = 0; i < nclients; i++)
+    rfs_disconnect(vcs[i].c);
+  return 0;
+}
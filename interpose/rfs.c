@@ -0,0 +1,665 @@
+/**
+ * @file rfs.c
+ * @brief Implements the asynchronous client API declared in `rfs.h`.
+ *
+ * Each connection keeps three FIFO queues of operations:
+ * - `sending`: requests not yet fully written to the non-blocking socket.
+ * Encoded request headers and user buffers go out together with `sendmsg()`.
+ * - `receiving`: requests on the wire whose responses have not arrived. The
+ * server answers in order, so the head is always the next response; READ
+ * data is received straight into the user's buffer.
+ * - `done`: completed operations without a callback, waiting for
+ * `rfs_reap()` and signaled through an eventfd.
+ *
+ * With `crc15440=1` in the environment, `rfs_connect()` asks for payload
+ * checksums (`OPTIONS`) before it hands out the connection, as `mylib.so`
+ * does. WRITE data then goes out with its CRC32C, and READ/PREAD data is
+ * checked against the CRC32C after it; a mismatch fails the read with EIO.
+ */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "checksum.h"
+#include "message.h"
+#include "rfs.h"
+#include "wire.h"
+
+#define MAXMSGLEN 1048575
+#define RFS_MAXIOV 4
+#define BUFLEN 2048
+
+struct rfs_op {
+  struct rfs_op *next;
+  rfs_callback cb;
+  rfs_result result;
+
+  request req;
+  unsigned char wire[WIRE_HEADER_SIZE + WIRE_MAX_BODY]; // encoded header+body
+  char *path;
+  struct iovec out[RFS_MAXIOV];
+  struct iovec *out_cur;
+  int out_cnt;
+  unsigned char sum_wire[WIRE_CRC_SIZE]; // CRC32C trailer, either direction
+  int crc;                               // the payload has the trailer
+
+  response res;
+  struct iovec in[RFS_MAXIOV];
+  struct iovec *in_cur;
+  int in_cnt;
+  int have_header;
+  size_t discard; // payload bytes that don't fit anywhere
+  void *data;     // READ/PREAD destination
+  size_t data_len;
+  struct stat *statbuf;
+  char *payload; // GETDIRTREE
+};
+
+struct op_queue {
+  struct rfs_op *head;
+  struct rfs_op *tail;
+};
+
+struct rfs_client {
+  int sockfd;
+  int efd;
+  int crc; // FEAT_CRC32C was negotiated on the connection
+  int pending;
+  struct op_queue sending;
+  struct op_queue receiving;
+  struct op_queue done;
+};
+
+static void push(struct op_queue *q, struct rfs_op *op) {
+  op->next = NULL;
+  if (q->tail)
+    q->tail->next = op;
+  else
+    q->head = op;
+  q->tail = op;
+}
+
+static struct rfs_op *pop(struct op_queue *q) {
+  struct rfs_op *op = q->head;
+  if (op) {
+    q->head = op->next;
+    if (q->head == NULL)
+      q->tail = NULL;
+  }
+  return op;
+}
+
+// Removes the last op of `q`, the one pushed most recently.
+static void drop_tail(struct op_queue *q) {
+  struct rfs_op *prev = NULL;
+  for (struct rfs_op *op = q->head; op != q->tail; op = op->next)
+    prev = op;
+  if (prev)
+    prev->next = NULL;
+  else
+    q->head = NULL;
+  q->tail = prev;
+}
+
+static void free_op(struct rfs_op *op) {
+  free(op->path);
+  free(op->payload);
+  free(op);
+}
+
+// Drops the first `n` bytes from an iovec array in place, returning the number
+// of entries that still have data left.
+static int iov_advance(struct iovec **iov, int cnt, size_t n) {
+  while (cnt > 0 && n >= (*iov)->iov_len) {
+    n -= (*iov)->iov_len;
+    (*iov)++;
+    cnt--;
+  }
+  if (cnt > 0) {
+    (*iov)->iov_base = (char *)(*iov)->iov_base + n;
+    (*iov)->iov_len -= n;
+  }
+  return cnt;
+}
+
+static struct dirtreenode *deserialize_to_dirtree(char *buf, size_t *nbyte) {
+  struct dirtreenode *tree = malloc(sizeof(struct dirtreenode));
+  char *offset = buf;
+
+  size_t entryname_len = strlen(offset) + 1;
+  tree->name = malloc(entryname_len);
+  memcpy(tree->name, offset, entryname_len);
+  offset += entryname_len;
+
+  tree->num_subdirs = wire_get_u32((unsigned char *)offset);
+  offset += WIRE_SIZE_u32;
+
+  tree->subdirs = malloc(tree->num_subdirs * sizeof(struct dirtreenode *));
+  size_t n = 0;
+  for (int i = 0; i < tree->num_subdirs; i++) {
+    tree->subdirs[i] = deserialize_to_dirtree(offset, &n);
+    offset += n;
+  }
+  if (nbyte != NULL) {
+    *nbyte = offset - buf;
+  }
+  return tree;
+}
+
+void rfs_freedirtree(struct dirtreenode *dt) {
+  if (dt == NULL)
+    return;
+  for (int i = 0; i < dt->num_subdirs; i++) {
+    rfs_freedirtree(dt->subdirs[i]);
+  }
+  free(dt->name);
+  free(dt->subdirs);
+  free(dt);
+}
+
+// Asks the server for payload checksums on the still blocking `sockfd`.
+// Returns whether it agreed, or -1 if the exchange failed.
+static int negotiate_crc(int sockfd) {
+  request r = {.header.opcode = OPTIONS};
+  r.req.options.features = FEAT_CRC32C;
+  unsigned char wire[WIRE_HEADER_SIZE + WIRE_MAX_BODY];
+  unsigned char *end =
+      wire_req_encode(OPTIONS, wire + WIRE_HEADER_SIZE, &r.req);
+  r.header.payload_len = end - wire - WIRE_HEADER_SIZE;
+  wire_req_header_encode(wire, &r.header);
+  for (unsigned char *p = wire; p < end;) {
+    ssize_t n = send(sockfd, p, end - p, MSG_NOSIGNAL);
+    if (n < 0 && errno != EINTR)
+      return -1;
+    p += n > 0 ? n : 0;
+  }
+
+  response res;
+  size_t len = WIRE_HEADER_SIZE + wire_res_size(OPTIONS);
+  for (size_t got = 0; got < len;) {
+    ssize_t n = recv(sockfd, wire + got, len - got, 0);
+    if (n == 0 || (n < 0 && errno != EINTR))
+      return -1;
+    got += n > 0 ? n : 0;
+  }
+  wire_res_header_decode(wire, &res.header);
+  wire_res_decode(OPTIONS, wire + WIRE_HEADER_SIZE, &res.res);
+  if (res.header.payload_len != wire_res_size(OPTIONS))
+    return -1;
+  return (res.res.options.features & FEAT_CRC32C) != 0;
+}
+
+rfs_client *rfs_connect(const char *serverip, unsigned short port) {
+  struct sockaddr_in srv;
+  memset(&srv, 0, sizeof(srv));
+  srv.sin_family = AF_INET;
+  srv.sin_addr.s_addr = inet_addr(serverip);
+  srv.sin_port = htons(port);
+
+  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (sockfd < 0)
+    return NULL;
+  char *env = getenv("crc15440");
+  int want_crc = env && atoi(env), crc = 0;
+  if (connect(sockfd, (struct sockaddr *)&srv, sizeof(struct sockaddr)) < 0 ||
+      (want_crc && (crc = negotiate_crc(sockfd)) < 0) ||
+      fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) < 0) {
+    close(sockfd);
+    return NULL;
+  }
+  if (want_crc && !crc)
+    fprintf(stderr, "[rfs.c]: server declined payload checksums\n");
+
+  rfs_client *c = calloc(1, sizeof(rfs_client));
+  c->sockfd = sockfd;
+  c->crc = crc;
+  c->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (c->efd < 0) {
+    close(sockfd);
+    free(c);
+    return NULL;
+  }
+  return c;
+}
+
+// Closes the connection. Operations still outstanding are dropped without
+// running their callbacks.
+void rfs_disconnect(rfs_client *c) {
+  struct op_queue *queues[] = {&c->sending, &c->receiving, &c->done};
+  for (int i = 0; i < 3; i++) {
+    struct rfs_op *op;
+    while ((op = pop(queues[i])))
+      free_op(op);
+  }
+  close(c->sockfd);
+  close(c->efd);
+  free(c);
+}
+
+int rfs_socket(rfs_client *c) { return c->sockfd; }
+
+int rfs_eventfd(rfs_client *c) { return c->efd; }
+
+int rfs_pending(rfs_client *c) { return c->pending; }
+
+short rfs_events(rfs_client *c) {
+  return POLLIN | (c->sending.head ? POLLOUT : 0);
+}
+
+static void complete(rfs_client *c, struct rfs_op *op) {
+  rfs_result *r = &op->result;
+  union res_union *res = &op->res.res;
+  size_t tail_len = op->res.header.payload_len;
+  switch (r->err ? -1 : r->opcode) {
+  case OPEN:
+    r->ret = res->open.ret_val;
+    break;
+  case READ:
+  case PREAD:
+    r->ret = res->read.nbyte;
+    if (op->crc &&
+        crc32c(0, op->data, tail_len) != wire_get_u32(op->sum_wire)) {
+      fprintf(stderr, "[rfs.c]: checksum mismatch in read data\n");
+      r->err = EIO;
+      r->ret = -1;
+    }
+    break;
+  case WRITE:
+    r->ret = res->write.ret_val;
+    break;
+  case CLOSE:
+    r->ret = res->close.ret_val;
+    break;
+  case LSEEK:
+    r->ret = res->lseek.off;
+    break;
+  case STAT:
+    r->ret = res->stat.ret_val;
+    if (r->ret == 0)
+      *op->statbuf = res->stat.statbuf;
+    break;
+  case UNLINK:
+    r->ret = res->unlink.ret_val;
+    break;
+  case COPY:
+    r->ret = res->copy.nbyte;
+    break;
+  case RMTREE:
+    r->ret = res->rmtree.nremoved;
+    break;
+  case GETDIRTREE:
+    // the names in the tree are read as strings; the last one must end
+    // inside the buffer even if the server's payload is cut short
+    if (tail_len > 0)
+      op->payload[tail_len] = '\0';
+    r->tree = tail_len > 0 ? deserialize_to_dirtree(op->payload, NULL) : NULL;
+    r->ret = r->tree ? 0 : -1;
+    break;
+  default:
+    break;
+  }
+  if (r->err == 0)
+    r->err = r->ret < 0 ? op->res.header.errno_value : 0;
+  c->pending--;
+
+  if (op->cb) {
+    op->cb(r);
+    free_op(op);
+  } else {
+    push(&c->done, op);
+    // EAGAIN means the counter is full, so the eventfd is readable already
+    uint64_t one = 1;
+    ssize_t n;
+    do
+      n = write(c->efd, &one, sizeof(one));
+    while (n < 0 && errno == EINTR);
+    if (n < 0 && errno != EAGAIN)
+      fprintf(stderr, "[rfs.c]: cannot signal a completion: %s\n",
+              strerror(errno));
+  }
+}
+
+// Fails every outstanding operation with `err` after the connection broke.
+static void fail_all(rfs_client *c, int err) {
+  struct op_queue *queues[] = {&c->receiving, &c->sending};
+  for (int i = 0; i < 2; i++) {
+    struct rfs_op *op;
+    while ((op = pop(queues[i]))) {
+      op->result.err = err;
+      op->result.ret = -1;
+      op->res.header.payload_len = 0;
+      complete(c, op);
+    }
+  }
+}
+
+// Decodes the header and fixed fields of `op`'s response and sets up where
+// the rest of the payload goes. header.payload_len is left counting only the
+// variable part, without a CRC32C trailer.
+static void expect_payload(rfs_client *c, struct rfs_op *op) {
+  int opcode = op->result.opcode;
+  size_t fixed = wire_res_size(opcode);
+  wire_res_header_decode(op->wire, &op->res.header);
+  wire_res_decode(opcode, op->wire + WIRE_HEADER_SIZE, &op->res.res);
+  size_t left = op->res.header.payload_len > fixed
+                    ? op->res.header.payload_len - fixed
+                    : 0;
+  // data that would not fit the caller's buffer can't be checked; it is
+  // discarded along with the trailer and the read fails
+  size_t trailer = c->crc && wire_res_crc(opcode) ? WIRE_CRC_SIZE : 0;
+  if (trailer && (left < trailer || left - trailer > op->data_len)) {
+    op->result.err = EIO;
+    op->result.ret = -1;
+    trailer = 0;
+  }
+  op->crc = trailer > 0;
+  left -= trailer;
+  op->res.header.payload_len = left;
+
+  struct iovec dst = {NULL, 0};
+  switch (opcode) {
+  case READ:
+  case PREAD:
+    dst = (struct iovec){op->data, op->data_len};
+    break;
+  case GETDIRTREE:
+    op->payload = malloc(left + 1);
+    if (op->payload == NULL) {
+      op->result.err = ENOMEM;
+      op->result.ret = -1;
+      break;
+    }
+    dst = (struct iovec){op->payload, left};
+    break;
+  default:
+    break;
+  }
+
+  op->in_cnt = 0;
+  if (dst.iov_len > 0 && left > 0) {
+    size_t len = dst.iov_len < left ? dst.iov_len : left;
+    op->in[op->in_cnt++] = (struct iovec){dst.iov_base, len};
+    left -= len;
+  }
+  if (op->crc)
+    op->in[op->in_cnt++] = (struct iovec){op->sum_wire, WIRE_CRC_SIZE};
+  op->in_cur = op->in;
+  op->discard = left;
+  op->have_header = 1;
+}
+
+static int flush_sends(rfs_client *c) {
+  struct rfs_op *op;
+  while ((op = c->sending.head)) {
+    struct msghdr msg = {.msg_iov = op->out_cur, .msg_iovlen = op->out_cnt};
+    ssize_t n = sendmsg(c->sockfd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        return 0;
+      return -1;
+    }
+    op->out_cnt = iov_advance(&op->out_cur, op->out_cnt, n);
+    if (op->out_cnt == 0)
+      push(&c->receiving, pop(&c->sending));
+  }
+  return 0;
+}
+
+int rfs_process(rfs_client *c) {
+  if (flush_sends(c) < 0) {
+    fail_all(c, errno);
+    return -1;
+  }
+
+  int completed = 0;
+  struct rfs_op *op;
+  while ((op = c->receiving.head)) {
+    ssize_t n;
+    char scratch[BUFLEN];
+    if (op->in_cnt == 0 && op->discard > 0) {
+      n = recv(c->sockfd, scratch,
+               op->discard < BUFLEN ? op->discard : BUFLEN, MSG_DONTWAIT);
+      if (n > 0)
+        op->discard -= n;
+    } else {
+      struct msghdr msg = {.msg_iov = op->in_cur, .msg_iovlen = op->in_cnt};
+      n = recvmsg(c->sockfd, &msg, MSG_DONTWAIT);
+      if (n > 0)
+        op->in_cnt = iov_advance(&op->in_cur, op->in_cnt, n);
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+      break;
+    if (n <= 0) {
+      fail_all(c, n == 0 ? ECONNRESET : errno);
+      return -1;
+    }
+
+    if (op->in_cnt > 0 || op->discard > 0)
+      continue;
+    if (!op->have_header) {
+      expect_payload(c, op);
+      if (op->in_cnt > 0 || op->discard > 0)
+        continue;
+    }
+    complete(c, pop(&c->receiving));
+    completed++;
+  }
+  return completed;
+}
+
+int rfs_wait(rfs_client *c, int timeout_ms) {
+  struct pollfd pfd = {.fd = c->sockfd, .events = rfs_events(c)};
+  int rv = poll(&pfd, 1, timeout_ms);
+  if (rv <= 0)
+    return rv < 0 && errno != EINTR ? -1 : 0;
+  return rfs_process(c);
+}
+
+int rfs_reap(rfs_client *c, rfs_result *results, int max) {
+  int n = 0;
+  struct rfs_op *op;
+  while (n < max && (op = pop(&c->done))) {
+    results[n++] = op->result;
+    free_op(op);
+  }
+  if (c->done.head == NULL) {
+    uint64_t count;
+    read(c->efd, &count, sizeof(count));
+  }
+  return n;
+}
+
+static struct rfs_op *new_op(enum OPCODE opcode, rfs_callback cb, void *arg) {
+  struct rfs_op *op = calloc(1, sizeof(struct rfs_op));
+  if (op == NULL)
+    return NULL;
+  op->cb = cb;
+  op->result.opcode = opcode;
+  op->result.arg = arg;
+  op->req.header.opcode = opcode;
+  return op;
+}
+
+// Queues `op`, whose request is the encoded op->req followed by `extra` (a
+// copied path or the user's data), and starts sending.
+static int submit(rfs_client *c, struct rfs_op *op, const void *extra,
+                  size_t extra_len) {
+  int opcode = op->req.header.opcode;
+  unsigned char *end =
+      wire_req_encode(opcode, op->wire + WIRE_HEADER_SIZE, &op->req.req);
+  op->req.header.payload_len = end - op->wire - WIRE_HEADER_SIZE + extra_len;
+  op->out[0] = (struct iovec){op->wire, end - op->wire};
+  op->out_cnt = 1;
+  if (extra_len > 0)
+    op->out[op->out_cnt++] = (struct iovec){(void *)extra, extra_len};
+  if (c->crc && wire_req_crc(opcode)) {
+    wire_put_u32(op->sum_wire, crc32c(0, extra, extra_len));
+    op->out[op->out_cnt++] = (struct iovec){op->sum_wire, WIRE_CRC_SIZE};
+    op->req.header.payload_len += WIRE_CRC_SIZE;
+  }
+  wire_req_header_encode(op->wire, &op->req.header);
+  op->out_cur = op->out;
+
+  // the same buffer receives the response header and fixed fields
+  op->in[0] =
+      (struct iovec){op->wire, WIRE_HEADER_SIZE + wire_res_size(opcode)};
+  op->in_cur = op->in;
+  op->in_cnt = 1;
+
+  push(&c->sending, op);
+  c->pending++;
+  if (flush_sends(c) < 0) {
+    // A send error leaves `op` at the tail of c->sending. Take it back out
+    // before failing the others so that its callback does not run, and keep
+    // the promise that -1 means nothing was queued.
+    int err = errno;
+    drop_tail(&c->sending);
+    c->pending--;
+    free_op(op);
+    fail_all(c, err);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+static int submit_path(rfs_client *c, struct rfs_op *op,
+                       const char *pathname) {
+  op->path = strdup(pathname);
+  if (op->path == NULL) {
+    free(op);
+    return -1;
+  }
+  return submit(c, op, op->path, strlen(op->path) + 1);
+}
+
+int rfs_open(rfs_client *c, const char *pathname, int flags, mode_t m,
+             rfs_callback cb, void *arg) {
+  struct rfs_op *op = new_op(OPEN, cb, arg);
+  if (op == NULL)
+    return -1;
+  op->req.req.open.flags = flags;
+  op->req.req.open.m = m;
+  return submit_path(c, op, pathname);
+}
+
+int rfs_read(rfs_client *c, int fd, void *buf, size_t nbyte, rfs_callback cb,
+             void *arg) {
+  struct rfs_op *op = new_op(READ, cb, arg);
+  if (op == NULL)
+    return -1;
+  op->req.req.read.fildes = fd;
+  op->req.req.read.nbyte = nbyte;
+  op->data = buf;
+  op->data_len = nbyte;
+  return submit(c, op, NULL, 0);
+}
+
+int rfs_pread(rfs_client *c, int fd, void *buf, size_t nbyte, off_t offset,
+              rfs_callback cb, void *arg) {
+  struct rfs_op *op = new_op(PREAD, cb, arg);
+  if (op == NULL)
+    return -1;
+  op->req.req.pread.fd = fd;
+  op->req.req.pread.nbyte = nbyte;
+  op->req.req.pread.offset = offset;
+  op->data = buf;
+  op->data_len = nbyte;
+  return submit(c, op, NULL, 0);
+}
+
+// Like write(2) on a remote fd, writes larger than the server's request
+// buffer complete as short writes.
+int rfs_write(rfs_client *c, int fd, const void *buf, size_t count,
+              rfs_callback cb, void *arg) {
+  struct rfs_op *op = new_op(WRITE, cb, arg);
+  if (op == NULL)
+    return -1;
+  if (count > MAXMSGLEN - offsetof(request, req.write.buf))
+    count = MAXMSGLEN - offsetof(request, req.write.buf);
+  op->req.req.write.fd = fd;
+  op->req.req.write.count = count;
+  return submit(c, op, buf, count);
+}
+
+int rfs_lseek(rfs_client *c, int fd, off_t offset, int whence,
+              rfs_callback cb, void *arg) {
+  struct rfs_op *op = new_op(LSEEK, cb, arg);
+  if (op == NULL)
+    return -1;
+  op->req.req.lseek.fd = fd;
+  op->req.req.lseek.offset = offset;
+  op->req.req.lseek.whence = whence;
+  return submit(c, op, NULL, 0);
+}
+
+int rfs_close(rfs_client *c, int fd, rfs_callback cb, void *arg) {
+  struct rfs_op *op = new_op(CLOSE, cb, arg);
+  if (op == NULL)
+    return -1;
+  op->req.req.close.fd = fd;
+  return submit(c, op, NULL, 0);
+}
+
+int rfs_stat(rfs_client *c, const char *pathname, struct stat *statbuf,
+             rfs_callback cb, void *arg) {
+  struct rfs_op *op = new_op(STAT, cb, arg);
+  if (op == NULL)
+    return -1;
+  op->statbuf = statbuf;
+  return submit_path(c, op, pathname);
+}
+
+int rfs_unlink(rfs_client *c, const char *pathname, rfs_callback cb,
+               void *arg) {
+  struct rfs_op *op = new_op(UNLINK, cb, arg);
+  if (op == NULL)
+    return -1;
+  return submit_path(c, op, pathname);
+}
+
+int rfs_getdirtree(rfs_client *c, const char *path, rfs_callback cb,
+                   void *arg) {
+  struct rfs_op *op = new_op(GETDIRTREE, cb, arg);
+  if (op == NULL)
+    return -1;
+  return submit_path(c, op, path);
+}
+
+int rfs_copy(rfs_client *c, const char *src, const char *dst, rfs_callback cb,
+             void *arg) {
+  struct rfs_op *op = new_op(COPY, cb, arg);
+  if (op == NULL)
+    return -1;
+  size_t src_len = strlen(src) + 1;
+  size_t dst_len = strlen(dst) + 1;
+  op->path = malloc(src_len + dst_len);
+  if (op->path == NULL) {
+    free(op);
+    return -1;
+  }
+  memcpy(op->path, src, src_len);
+  memcpy(op->path + src_len, dst, dst_len);
+  op->req.req.copy.src_len = src_len;
+  return submit(c, op, op->path, src_len + dst_len);
+}
+
+int rfs_rmtree(rfs_client *c, const char *path, rfs_callback cb, void *arg) {
+  struct rfs_op *op = new_op(RMTREE, cb, arg);
+  if (op == NULL)
+    return -1;
+  return submit_path(c, op, path);
+}
@@ -0,0 +1,92 @@
+/**
+ * @file rfs.h
+ * @brief Asynchronous client API for the remote file server.
+ *
+ * Unlike `mylib.so`, which interposes on blocking libc calls, this library
+ * lets a program submit many operations on one connection and pick up their
+ * results later, from a single thread. It speaks the same protocol as the
+ * interposer (`message.h`), so it works against an unmodified `server`.
+ *
+ * Usage:
+ * - `rfs_connect()` opens a connection. Its socket is non-blocking.
+ * - `rfs_open()`, `rfs_read()`, ... queue an operation and return at once.
+ *   Buffers passed in (paths are copied) must stay valid until completion.
+ * - Drive the connection from an event loop: wait for `rfs_socket()` to be
+ *   ready for `rfs_events()`, then call `rfs_process()`. `rfs_wait()` does
+ *   both for programs without their own loop.
+ * - A finished operation runs its callback from `rfs_process()`. Operations
+ *   submitted without a callback are queued instead; `rfs_eventfd()` becomes
+ *   readable while any are queued, and `rfs_reap()` collects them.
+ *
+ * With `crc15440=1` in the environment, connections carry CRC32C checksums of
+ * file data like those of `mylib.so`; a read whose data fails its checksum
+ * completes with EIO.
+ *
+ * The server handles requests of a connection in order, so operations
+ * complete in the order they were submitted. Remote fds are only valid on
+ * the connection that opened them.
+ */
+#ifndef __RFS_H__
+#define __RFS_H__
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "../include/dirtree.h"
+
+typedef struct rfs_client rfs_client;
+
+typedef struct rfs_result {
+  int opcode;   // enum OPCODE of the operation
+  int err;      // errno value if ret is negative, 0 otherwise
+  ssize_t ret;  // fd, byte count, offset or 0, as the libc call would return,
+                // or the count described with rfs_copy() and rfs_rmtree()
+  void *arg;    // as passed at submission
+  struct dirtreenode *tree; // rfs_getdirtree(): free with rfs_freedirtree()
+} rfs_result;
+
+typedef void (*rfs_callback)(const rfs_result *res);
+
+rfs_client *rfs_connect(const char *serverip, unsigned short port);
+void rfs_disconnect(rfs_client *c);
+
+// Submission; each returns 0, or -1 with errno set if nothing was queued.
+int rfs_open(rfs_client *c, const char *pathname, int flags, mode_t m,
+             rfs_callback cb, void *arg);
+int rfs_read(rfs_client *c, int fd, void *buf, size_t nbyte, rfs_callback cb,
+             void *arg);
+int rfs_pread(rfs_client *c, int fd, void *buf, size_t nbyte, off_t offset,
+              rfs_callback cb, void *arg);
+int rfs_write(rfs_client *c, int fd, const void *buf, size_t count,
+              rfs_callback cb, void *arg);
+int rfs_lseek(rfs_client *c, int fd, off_t offset, int whence,
+              rfs_callback cb, void *arg);
+int rfs_close(rfs_client *c, int fd, rfs_callback cb, void *arg);
+int rfs_stat(rfs_client *c, const char *pathname, struct stat *statbuf,
+             rfs_callback cb, void *arg);
+int rfs_unlink(rfs_client *c, const char *pathname, rfs_callback cb,
+               void *arg);
+int rfs_getdirtree(rfs_client *c, const char *path, rfs_callback cb,
+                   void *arg);
+void rfs_freedirtree(struct dirtreenode *dt);
+
+// Operations the server carries out on its own files, without moving their
+// data over the connection. rfs_copy() copies `src` to `dst` and completes
+// with the bytes copied; rfs_rmtree() removes `path` recursively and
+// completes with the number of files and directories removed.
+int rfs_copy(rfs_client *c, const char *src, const char *dst, rfs_callback cb,
+             void *arg);
+int rfs_rmtree(rfs_client *c, const char *path, rfs_callback cb, void *arg);
+
+// Event loop integration.
+int rfs_socket(rfs_client *c);
+short rfs_events(rfs_client *c); // POLLIN, plus POLLOUT while sends queue up
+int rfs_process(rfs_client *c);  // returns completions, -1 if disconnected
+int rfs_wait(rfs_client *c, int timeout_ms);
+int rfs_pending(rfs_client *c);  // operations not completed yet
+
+// Completions of operations submitted without a callback.
+int rfs_eventfd(rfs_client *c);
+int rfs_reap(rfs_client *c, rfs_result *results, int max);
+
+#endif
@@ -8,10 +8,56 @@
  *
  * Features:
  * - **Request Handling**: Uses `get_request()` to read incoming RPC requests.
- * - **Response Transmission**: Sends results back using `send()`.
+ * - **Response Transmission**: Sends results back using `send_response()`.
+ * Requests and responses use the fixed-width little-endian encoding of
+ * `wire.h`, with only the fields of their opcode on the wire.
  * - **Directory Tree Serialization**: Implements `serialize_dirtree()` to
  * convert hierarchical directory structures into a serialized format.
+ * - **Batched Listing**: `READDIRPLUS` returns directory entries together with
+ * the `stat()` result of each one, so listings don't need an RPC per entry.
+ * - **Delta Writes**: `CHECKSUMS` exposes block checksums around the file
+ * offset and `DELTA` rebuilds new data from copied blocks plus literals.
+ * Files opened for delta writes with `O_TRUNC` are truncated right away;
+ * where the filesystem has reflinks, a snapshot of their old content is what
+ * blocks are copied from. Every copied run is checked against the strong
+ * checksums the client matched, so a stale match fails with `ESTALE`.
+ * - **Handle Cache**: Read-only regular files closed by the client are kept
+ * open in a small per-session cache and reused by a later `OPEN` of the same
+ * path and flags if the path still names the same inode.
  * - **Concurrent Processing**: Uses `fork()` to handle multiple clients.
+ * - **Metadata Channel**: A client can open a second connection for metadata
+ * requests (`OPTIONS`, then `ATTACH` on the new connection). The process that
+ * accepts it passes it to the client's session process over a unix socket,
+ * where a thread serves it; a waiting metadata request runs before the next
+ * bulk request, so it never queues behind a stream of large transfers.
+ * - **Bulk Operations**: `COPY` duplicates a file on the server with a reflink
+ * or `copy_file_range()`, and `RMTREE` removes a whole tree, unlinking its
+ * files from several threads, so neither moves file data over the network.
+ * - **Payload Checksums**: A client can turn on CRC32C of file data with
+ * `OPTIONS`. Read data is checksummed piece by piece as it is read, and
+ * WRITE and DELTA data while it is received; requests whose checksum does
+ * not match fail with `EIO` without touching the file.
+ * - **Sparse Reads**: With `FEAT_SPARSE`, reads of files with holes find them
+ * with `SEEK_DATA`/`SEEK_HOLE` and send only the allocated data plus a list
+ * of the holes (`read_sparse()`), so a sparse file costs its data to read,
+ * not its size.
+ * - **Read-Ahead**: Sequential and strided (striped) reads of an fd are
+ * detected per session; the data ahead of them is requested with
+ * `POSIX_FADV_WILLNEED` and read into the page cache by a prefetch thread,
+ * while backward seeks disable kernel read-ahead for the fd.
+ * - **Fair Scheduling**: Bulk requests of all sessions are admitted through a
+ * deficit round robin scheduler in shared memory, under a server-wide budget
+ * of in-flight bytes (`budget15440`). The round robin is over clients, not
+ * connections: sessions that name the same client id in `OPTIONS` share one
+ * deficit, so shard and stripe connections don't buy a larger share.
+ * Metadata requests skip it. At most `MAX_SESSIONS` connections are served
+ * at once; the listening process stops accepting while that many are open.
+ * - **Leases**: `LEASE` answers a stat with a lease on the inode (or on the
+ * nearest existing directory, for a missing path) from a table in shared
+ * memory. Every request that changes a file or directory entry first recalls
+ * the conflicting leases of other sessions over their callback channels and
+ * waits until they are released or their term (`leaseterm15440` ms) runs
+ * out, while new grants on the inode wait for the change to finish.
  * - **Socket Management**: Listens for incoming connections and processes them
  * in a loop.
  *
@@ -27,56 +73,329 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
+#include <linux/fs.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "../include/dirtree.h"
+#include "checksum.h"
 #include "message.h"
+#include "wire.h"
 
 #define MAXMSGLEN 1048575
+#define MAX_TRACKED_FD 1024
+#define HANDLE_CACHE_SIZE 32
+#define MAX_SESSIONS 1024
+#define INFLIGHT_BUDGET (8 << 20)
+#define DRR_QUANTUM (64 << 10)
+#define SMALL_OP_COST 4096
+#define DIRTREE_COST (256 << 10)
+#define COPY_COST (1 << 20)
+#define COPY_CHUNK (64 << 20)
+#define RMTREE_THREADS 8
+#define CRC_CHUNK (64 << 10)
+#define SPARSE_MIN_HOLE 4096 // shorter runs of zeros are sent as data
+#define RA_MIN_WINDOW (128 << 10)
+#define RA_MAX_WINDOW (4 << 20)
+#define RA_SEQ_READS 2 // sequential reads in a row before read-ahead starts
+#define PREFETCH_QUEUE 16
+#define PREFETCH_CHUNK (256 << 10)
+#define LEASE_BUCKETS 1024
+#define LEASE_WAYS 8
+#define LEASE_INDEX_BITS 13 // LEASE_BUCKETS * LEASE_WAYS entries
+#define LEASE_TERM_MS 1000
+#define RECALL_BATCH 64
+#define REFLINK_NO_DEVS 16 // devices remembered to have no reflinks
+
+// Snapshot of the content a file had before it was opened for delta writes
+// with O_TRUNC, plus one, by client fd (0 if none). It is an unlinked file
+// only this session sees, so the blocks CHECKSUMS describes stay put.
+int delta_snapshot[MAX_TRACKED_FD];
+
+// A read-only regular file opened for the client. While the client has it
+// open it sits in open_handles[fd]; after CLOSE it moves to handle_cache.
+struct handle {
+  int fd;
+  int flags;
+  dev_t dev;
+  ino_t ino;
+  unsigned long last_used;
+  char *path;
+};
+
+struct handle *open_handles[MAX_TRACKED_FD];
+struct handle *handle_cache[HANDLE_CACHE_SIZE];
+int nhandles = 0;
+unsigned long handle_clock = 0;
+
+// Paths collected by rmtree(): files are unlinked by RMTREE_THREADS threads
+// taking the next index, then the directories are removed in post-order.
+struct rmtree_list {
+  char **paths;
+  size_t len, cap;
+};
+
+struct rmtree_list rm_files, rm_dirs;
+size_t rm_next;
+int rm_err;
+ssize_t rm_removed;
+
+// FEAT_* enabled by the client with OPTIONS
+uint32_t session_features = 0;
+// the WRITE data of the current request did not match its checksum
+__thread int bad_crc = 0;
+
+// With a metadata channel, its thread and the main thread take turns
+// executing requests; a waiting metadata request goes first. A request gives
+// up its turn once the session state is no longer needed, before sending a
+// large response (session_leave()).
+pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t session_cond = PTHREAD_COND_INITIALIZER;
+int session_busy = 0;
+int meta_waiting = 0;
+int meta_channel = 0;         // a metadata channel was offered
+__thread int session_held = 0; // this thread has the turn
+
+void session_leave();
+
+// Scheduler state of one session (connection).
+struct sched_slot {
+  pid_t pid;       // session process, -1 until it is forked, 0 if free
+  int client;      // index of its sched_client
+  int waiting;     // a bulk request is waiting for admission
+  int granted;     // ... and has been admitted
+  uint64_t ticket; // when it started waiting, to serve a client's in order
+  size_t want;     // cost of the waiting request
+  size_t held;     // bytes admitted and not released yet
+};
+
+// The sessions of one client, which the round robin visits as one.
+struct sched_client {
+  uint64_t id;    // from options_req, 0 for a session that named none
+  int sessions;   // sessions in it, 0 if the entry is free
+  size_t deficit; // deficit round robin credit
+};
+
+// Shared by the listening process and all session processes. There are never
+// more clients than sessions, and the lowest free client entry is taken, so a
+// session always finds one below `used`.
+struct scheduler {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t budget;    // bytes of bulk requests allowed in flight server-wide
+  size_t inflight;  // bytes of bulk requests admitted and not finished
+  int next;         // client the round robin visits next
+  int used;         // slots ever handed out; the ones above are all free
+  uint64_t tickets; // waits started so far
+  struct sched_slot slots[MAX_SESSIONS];
+  struct sched_client clients[MAX_SESSIONS];
+};
+
+struct scheduler *sched;
+int my_slot = -1;
+
+// A lease a session holds on a file or directory, see lease_res.
+struct lease {
+  uint64_t id; // 0 if the entry is free; its index is in the low bits
+  dev_t dev;
+  ino_t ino;
+  int slot;     // scheduler slot of the holding session
+  int mode;     // LEASE_READ or LEASE_WRITE
+  int recall;   // 1: to be recalled, 2: RECALL sent
+  long expires; // CLOCK_MONOTONIC nanoseconds
+};
+
+// The leases on the inodes that hash to a bucket. `busy` counts changes to
+// them in progress, which hold back new grants until they are done, so no
+// grant hands out attributes from the middle of a change.
+struct lease_bucket {
+  int busy;
+  struct lease ways[LEASE_WAYS];
+};
+
+// Shared by the listening process and all session processes.
+struct lease_table {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;        // a lease was freed or a change ended
+  pthread_cond_t recall_cond; // recalls[] went up
+  int enabled;                // some session asked for leases
+  int busy_all;               // changes to everything (RMTREE) in progress
+  uint64_t next_id;
+  long term; // nanoseconds a grant is valid
+  int recalls[MAX_SESSIONS]; // leases of each session to recall
+  struct lease_bucket buckets[LEASE_BUCKETS];
+};
+
+struct lease_table *leases;
+int callback_channel = 0; // a callback channel was offered
+int callback_fd = -1;
+
+// Inodes a request is about to change, announced with lease_begin() so that
+// other sessions' leases on them are recalled first.
+struct change {
+  int all; // everything, e.g. a whole tree is removed
+  int n;
+  struct stat st[2];
+};
+
+#define CHANGE_FILE 1   // the file, if it exists
+#define CHANGE_ENTRY 2  // the entries of its directory
+#define CHANGE_CREATE 4 // ... if the file does not exist yet
+
+// Access pattern of a client fd. A read continues the stream if it starts
+// where the previous one ended, or further on by the same stride as the one
+// before it, which is what each connection of a striped read sees. Once
+// RA_SEQ_READS reads in a row continue it, the data ahead is prefetched: in
+// windows that double up to RA_MAX_WINDOW for contiguous reads, the next
+// stride for strided ones. A forward skip only starts a new stream; a read
+// behind the previous one turns kernel read-ahead off for the fd.
+struct readahead {
+  off_t last;    // offset of the last read
+  off_t next;    // offset right after the last read
+  off_t stride;  // distance between the starts of the last two reads
+  off_t ahead;   // prefetched up to here
+  size_t window; // size of the next prefetch
+  int seq;       // reads in a row that continue the stream
+  int random;    // POSIX_FADV_RANDOM is in effect
+};
+
+struct readahead ra[MAX_TRACKED_FD];
+
+// Ranges for the prefetch thread; each holds its own dup() of the fd.
+struct prefetch_job {
+  int fd;
+  off_t off;
+  size_t len;
+};
+
+struct prefetch_job prefetch_queue[PREFETCH_QUEUE];
+int prefetch_head = 0;
+int prefetch_len = 0;
+int prefetch_started = 0;
+pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
 
 // server:
 // getrequest
 // sendresponse
 
-int get_request(request *req, int sessfd) {
-  size_t header_len = sizeof(req_header);
-
+// Receives exactly `len` bytes, returning -1 if the connection ends first.
+// With `crc`, the bytes are also added to that CRC32C as they arrive.
+int recv_all(int sessfd, void *buf, size_t len, uint32_t *crc) {
   size_t read_cnt = 0;
-  while (read_cnt < header_len) {
+  while (read_cnt < len) {
     // convert to char* to do pointer arithmetic
     ssize_t bytes_received =
-        recv(sessfd, (char *)req + read_cnt, header_len - read_cnt, 0);
+        recv(sessfd, (char *)buf + read_cnt, len - read_cnt, 0);
+    if (bytes_received < 0 && errno == EINTR)
+      continue;
     if (bytes_received <= 0) {
       return -1;
     }
+    if (crc)
+      *crc = crc32c(*crc, (char *)buf + read_cnt, bytes_received);
     read_cnt += bytes_received;
   }
+  return 0;
+}
 
-  read_cnt = 0;
+// Receives a request and decodes it into `req`, a MAXMSGLEN + 1 buffer. The
+// variable part lands where message.h puts it, and header.payload_len is
+// rewritten to describe that host layout.
+int get_request(request *req, int sessfd) {
+  unsigned char wire[WIRE_HEADER_SIZE + WIRE_MAX_BODY];
+  if (recv_all(sessfd, wire, WIRE_HEADER_SIZE, NULL) != 0)
+    return -1;
+  wire_req_header_decode(wire, &req->header);
   fprintf(stderr, "server: func: %d, payload length: %ld\n", req->header.opcode,
           req->header.payload_len);
 
-  while (read_cnt < req->header.payload_len) {
-    fprintf(stderr, "try to read payload\n");
-    ssize_t bytes_received = recv(sessfd, (char *)req + header_len + read_cnt,
-                                  req->header.payload_len - read_cnt, 0);
-    if (bytes_received <= 0) {
-      return -1;
-    }
-    read_cnt += bytes_received;
+  int opcode = req->header.opcode;
+  long fixed = wire_req_size(opcode);
+  size_t tail_off = offsetof(request, req) + wire_req_tail(opcode);
+  int crc = (session_features & FEAT_CRC32C) && wire_req_crc(opcode);
+  size_t trailer = crc ? WIRE_CRC_SIZE : 0;
+  if (req->header.version != WIRE_VERSION || fixed < 0 ||
+      req->header.payload_len < fixed + trailer ||
+      req->header.payload_len - fixed - trailer > MAXMSGLEN - tail_off) {
+    fprintf(stderr, "[server.c] Malformed request.\n");
+    return -1;
   }
+  size_t tail_len = req->header.payload_len - fixed - trailer;
+
+  uint32_t sum = 0;
+  uint32_t *tail_sum = crc ? &sum : NULL;
+  unsigned char sum_wire[WIRE_CRC_SIZE];
+  if (recv_all(sessfd, wire, fixed, NULL) != 0 ||
+      recv_all(sessfd, (char *)req + tail_off, tail_len, tail_sum) != 0 ||
+      recv_all(sessfd, sum_wire, trailer, NULL) != 0)
+    return -1;
+  bad_crc = crc && wire_get_u32(sum_wire) != sum;
+  wire_req_decode(opcode, wire, &req->req);
+  // paths are sent with their NUL, but don't rely on it
+  ((char *)req)[tail_off + tail_len] = '\0';
+  req->header.payload_len = tail_off + tail_len - sizeof(req_header);
 
   fprintf(stderr, "server: func: %d\n", req->header.opcode);
   return 0;
 }
 
+// Sends every byte described by `iov`, retrying on short writes.
+int send_iov(int sessfd, struct iovec *iov, int cnt) {
+  while (cnt > 0) {
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = cnt};
+    ssize_t n = sendmsg(sessfd, &msg, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (cnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+// Sends `res` for `opcode`: the header and the fixed fields of the opcode in
+// wire encoding, followed by the `tail` bytes as they are.
+int send_response(int sessfd, int opcode, response *res, struct iovec *tail,
+                  int tail_cnt) {
+  unsigned char wire[WIRE_HEADER_SIZE + WIRE_MAX_BODY];
+  unsigned char *end =
+      wire_res_encode(opcode, wire + WIRE_HEADER_SIZE, &res->res);
+  struct iovec iov[4] = {{wire, end - wire}};
+  res->header.payload_len = end - wire - WIRE_HEADER_SIZE;
+  for (int i = 0; i < tail_cnt; i++) {
+    iov[i + 1] = tail[i];
+    res->header.payload_len += tail[i].iov_len;
+  }
+  wire_res_header_encode(wire, &res->header);
+  return send_iov(sessfd, iov, tail_cnt + 1);
+}
+
 char *serialize_dirtree(struct dirtreenode *root, size_t *size) {
   if (root == NULL) {
     fprintf(stderr, "This shouldn't happen\n");
@@ -92,14 +411,13 @@ char *serialize_dirtree(struct dirtreenode *root, size_t *size) {
     subtree_buffer_len += nbyte;
   }
   size_t entryname_len = strlen(root->name) + 1;
-  size_t total_len = entryname_len + sizeof(int) + subtree_buffer_len;
+  size_t total_len = entryname_len + WIRE_SIZE_u32 + subtree_buffer_len;
   char *res = (char *)malloc(total_len);
 
   char *offset = res;
   memcpy(offset, root->name, entryname_len);
   offset += entryname_len;
-  memcpy(offset, &root->num_subdirs, sizeof(int));
-  offset += sizeof(int);
+  offset = (char *)wire_put_u32((unsigned char *)offset, root->num_subdirs);
 
   for (int i = 0; i < root->num_subdirs; i++) {
     memcpy(offset, buffers[i], lens[i]);
@@ -123,104 +441,1684 @@ void recursive_free(struct dirtreenode *dt) {
   free(dt);
 }
 
+// Where DELTA copies blocks of `fd` from: its snapshot, or the file itself.
+int delta_source(int fd) {
+  if (fd >= 0 && fd < MAX_TRACKED_FD && delta_snapshot[fd])
+    return delta_snapshot[fd] - 1;
+  return fd;
+}
+
+void drop_snapshot(int fd) {
+  if (fd >= 0 && fd < MAX_TRACKED_FD && delta_snapshot[fd]) {
+    close(delta_snapshot[fd] - 1);
+    delta_snapshot[fd] = 0;
+  }
+}
+
+// Takes a reflink snapshot of the regular file at `pathname` in its
+// directory. Returns its fd, or -1 if the file is empty or the filesystem
+// cannot share the blocks; devices that could not are remembered, so their
+// files are not tried again.
+int reflink_snapshot(const char *pathname) {
+  static dev_t no_reflink[REFLINK_NO_DEVS];
+  static int nno_reflink = 0;
+  struct stat st;
+  int old = open(pathname, O_RDONLY | O_NONBLOCK);
+  if (old < 0)
+    return -1;
+  int ok = fstat(old, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+  for (int i = 0; ok && i < nno_reflink; i++)
+    if (no_reflink[i] == st.st_dev)
+      ok = 0;
+  int snap = -1;
+  if (ok) {
+    // in the file's directory, so a reflink is possible
+    char *dir = strdup(pathname);
+    char *slash = strrchr(dir, '/');
+    if (slash)
+      *(slash == dir ? slash + 1 : slash) = '\0';
+    snap = open(slash ? dir : ".", O_TMPFILE | O_RDWR, 0600);
+    free(dir);
+  }
+  if (snap >= 0 && ioctl(snap, FICLONE, old) < 0) {
+    if ((errno == EOPNOTSUPP || errno == EXDEV || errno == EINVAL) &&
+        nno_reflink < REFLINK_NO_DEVS)
+      no_reflink[nno_reflink++] = st.st_dev;
+    close(snap);
+    snap = -1;
+  }
+  close(old);
+  return snap;
+}
+
+// Opens a file the client wants to rewrite with DELTA. Without O_TRUNC it is
+// opened readable, so blocks can be copied from it. With O_TRUNC it is opened
+// as asked, and blocks are copied from a snapshot of the old content if a
+// reflink could take one; otherwise the truncation costs nothing extra and
+// the rewrite is sent with plain WRITEs.
+int open_for_delta(const char *pathname, int flags, mode_t m) {
+  if (!(flags & O_TRUNC)) {
+    int fd = open(pathname, (flags & ~O_ACCMODE) | O_RDWR, m);
+    return fd >= 0 ? fd : open(pathname, flags, m);
+  }
+  int snap = reflink_snapshot(pathname);
+  int fd = open(pathname, flags, m);
+  if (snap >= 0 && fd >= 0 && fd < MAX_TRACKED_FD)
+    delta_snapshot[fd] = snap + 1;
+  else if (snap >= 0)
+    close(snap);
+  return fd;
+}
+
+// Checksums the full blocks of [pos - len, pos + 2 * len) that exist in the
+// file, or in its snapshot, which covers data shifted by edits within a
+// rewrite of `len` bytes.
+void checksums(checksums_req *cr, int sessfd) {
+  size_t block_size = cr->block_size;
+  size_t len = cr->len;
+  if (block_size == 0 || len > MAXMSGLEN)
+    len = block_size = 0;
+
+  response res = {0};
+  struct stat st;
+  int src = delta_source(cr->fd);
+  res.res.checksums.pos = lseek(cr->fd, 0, SEEK_CUR);
+  if (res.res.checksums.pos < 0 || fstat(src, &st) < 0) {
+    res.header.errno_value = errno;
+    res.res.checksums.ret_val = -1;
+    send_response(sessfd, CHECKSUMS, &res, NULL, 0);
+    return;
+  }
+
+  off_t pos = res.res.checksums.pos;
+  off_t start = pos > (off_t)len ? pos - (off_t)len : 0;
+  off_t end = pos + 2 * (off_t)len;
+  if (end > st.st_size)
+    end = st.st_size;
+  size_t nblocks = end > start && block_size ? (end - start) / block_size : 0;
+
+  char *data = malloc(nblocks * block_size);
+  ssize_t got = pread(src, data, nblocks * block_size, start);
+  if (got < 0) {
+    res.header.errno_value = errno;
+    res.res.checksums.ret_val = -1;
+    got = 0;
+  }
+  nblocks = got / (block_size ? block_size : 1);
+
+  unsigned char *sums = malloc(nblocks * WIRE_SIZE_block_sum);
+  unsigned char *p = sums;
+  for (size_t i = 0; i < nblocks; i++) {
+    unsigned char *b = (unsigned char *)data + i * block_size;
+    block_sum sum = {weak_sum(b, block_size), strong_sum(b, block_size)};
+    p = wire_block_sum_encode(p, &sum);
+  }
+  free(data);
+
+  res.res.checksums.size = st.st_size;
+  res.res.checksums.start = start;
+  res.res.checksums.nblocks = nblocks;
+  struct iovec iov[] = {{sums, p - sums}};
+  session_leave();
+  send_response(sessfd, CHECKSUMS, &res, iov, 1);
+  free(sums);
+}
+
+// Rebuilds the new data from a DELTA request and writes it at the current
+// offset. Fails with EINVAL on a malformed request, EIO if a copied block is
+// no longer there and ESTALE if it changed since CHECKSUMS, leaving the file
+// untouched.
+ssize_t apply_delta(delta_req *dr, size_t payload_len) {
+  size_t ops_len = dr->nops * WIRE_SIZE_delta_op;
+  if (dr->nops > MAXMSGLEN / WIRE_SIZE_delta_op || dr->block_size == 0 ||
+      offsetof(delta_req, buf) + ops_len + dr->literal_len > payload_len) {
+    errno = EINVAL;
+    return -1;
+  }
+  delta_op *ops = malloc(dr->nops * sizeof(delta_op));
+  const unsigned char *p = (unsigned char *)dr->buf;
+  char *literal = dr->buf + ops_len;
+
+  size_t total = 0;
+  for (size_t i = 0; i < dr->nops; i++) {
+    p = wire_delta_op_decode(p, &ops[i]);
+    total += ops[i].len;
+    if (ops[i].len > MAXMSGLEN || total > MAXMSGLEN ||
+        (ops[i].src >= 0 && ops[i].len % dr->block_size != 0)) {
+      free(ops);
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  int src = delta_source(dr->fd);
+  char *out = malloc(total);
+  size_t off = 0, lit = 0;
+  for (size_t i = 0; i < dr->nops; i++) {
+    if (ops[i].src >= 0) {
+      if (pread(src, out + off, ops[i].len, ops[i].src) !=
+          (ssize_t)ops[i].len) {
+        free(out);
+        free(ops);
+        errno = EIO;
+        return -1;
+      }
+      uint64_t run = STRONG_RUN_INIT;
+      for (size_t b = 0; b < ops[i].len; b += dr->block_size)
+        run = strong_run_add(
+            run, strong_sum((unsigned char *)out + off + b, dr->block_size));
+      if (run != ops[i].strong) {
+        free(out);
+        free(ops);
+        errno = ESTALE;
+        return -1;
+      }
+    } else {
+      if (lit + ops[i].len > dr->literal_len) {
+        free(out);
+        free(ops);
+        errno = EINVAL;
+        return -1;
+      }
+      memcpy(out + off, literal + lit, ops[i].len);
+      lit += ops[i].len;
+    }
+    off += ops[i].len;
+  }
+
+  ssize_t cnt = write(dr->fd, out, total);
+  free(out);
+  free(ops);
+  return cnt;
+}
+
+// Encodes the struct dirent records in entries[0, len) as dirent_rec entries
+// into `out`, which needs `len` bytes: no record is shorter than its wire
+// form. Returns the bytes written and sets *count to the number of entries.
+size_t encode_dirents(const char *entries, size_t len, unsigned char *out,
+                      size_t *count) {
+  unsigned char *p = out;
+  *count = 0;
+  for (size_t off = 0; off < len;) {
+    struct dirent *d = (struct dirent *)(entries + off);
+    size_t name_len = strlen(d->d_name);
+    dirent_rec rec = {d->d_ino, d->d_off, d->d_type, name_len};
+    p = wire_dirent_rec_encode(p, &rec);
+    memcpy(p, d->d_name, name_len);
+    p += name_len;
+    off += d->d_reclen;
+    (*count)++;
+  }
+  return p - out;
+}
+
+// Reads a page of directory entries like GETDIRENTRIES and appends the stat
+// data of every entry after the records.
+void readdirplus(direntries_req *dr, int sessfd) {
+  size_t nbytes = dr->nbytes < MAXMSGLEN ? dr->nbytes : MAXMSGLEN;
+  char *entries = malloc(nbytes);
+  response res = {0};
+  ssize_t n =
+      getdirentries(dr->fd, entries, nbytes, &res.res.readdirplus.basep);
+  res.header.errno_value = errno;
+
+  size_t entries_len = n > 0 ? n : 0;
+  size_t nattrs;
+  unsigned char *recs = malloc(entries_len);
+  size_t recs_len = encode_dirents(entries, entries_len, recs, &nattrs);
+  res.res.readdirplus.ret_val = n < 0 ? -1 : (ssize_t)recs_len;
+
+  unsigned char *attrs = malloc(nattrs * WIRE_SIZE_entry_attr);
+  unsigned char *p = attrs;
+  for (size_t off = 0; off < entries_len;) {
+    struct dirent *d = (struct dirent *)(entries + off);
+    entry_attr a;
+    a.ret_val = fstatat(dr->fd, d->d_name, &a.statbuf, 0);
+    p = wire_entry_attr_encode(p, &a);
+    off += d->d_reclen;
+  }
+
+  res.res.readdirplus.nattrs = nattrs;
+  struct iovec iov[] = {{recs, recs_len}, {attrs, p - attrs}};
+  session_leave();
+  send_response(sessfd, READDIRPLUS, &res, iov, 2);
+  free(entries);
+  free(recs);
+  free(attrs);
+}
+
+void drop_cached_handle(int i) {
+  close(handle_cache[i]->fd);
+  free(handle_cache[i]->path);
+  free(handle_cache[i]);
+  handle_cache[i] = handle_cache[--nhandles];
+}
+
+// Parks a handle the client closed, evicting the least recently used one if
+// the cache is full.
+void cache_handle(struct handle *h) {
+  if (nhandles == HANDLE_CACHE_SIZE) {
+    int lru = 0;
+    for (int i = 1; i < nhandles; i++)
+      if (handle_cache[i]->last_used < handle_cache[lru]->last_used)
+        lru = i;
+    drop_cached_handle(lru);
+  }
+  h->last_used = ++handle_clock;
+  handle_cache[nhandles++] = h;
+}
+
+// Closes cached handles of the inode `path` currently names, e.g. before it
+// is unlinked, so the file is not kept alive by the cache.
+void evict_handles(const char *path) {
+  struct stat st;
+  if (nhandles == 0 || stat(path, &st) < 0)
+    return;
+  for (int i = nhandles - 1; i >= 0; i--)
+    if (handle_cache[i]->dev == st.st_dev && handle_cache[i]->ino == st.st_ino)
+      drop_cached_handle(i);
+}
+
+int cacheable_open(int flags) {
+  return (flags & O_ACCMODE) == O_RDONLY &&
+         !(flags & (O_CREAT | O_TRUNC | O_DIRECTORY | O_PATH | O_TMPFILE));
+}
+
+// Opens `pathname` read-only, reusing a cached handle if the path still
+// refers to the same inode, and tracks the fd so CLOSE can cache it.
+int open_cached(const char *pathname, int flags) {
+  struct stat st;
+  for (int i = 0; i < nhandles; i++) {
+    struct handle *h = handle_cache[i];
+    if (h->flags != flags || strcmp(h->path, pathname) != 0)
+      continue;
+    if (stat(pathname, &st) < 0 || st.st_dev != h->dev || st.st_ino != h->ino) {
+      // renamed over or removed since it was cached
+      drop_cached_handle(i);
+      break;
+    }
+    handle_cache[i] = handle_cache[--nhandles];
+    lseek(h->fd, 0, SEEK_SET);
+    open_handles[h->fd] = h;
+    return h->fd;
+  }
+
+  int fd = open(pathname, flags);
+  if (fd < 0 || fd >= MAX_TRACKED_FD || fstat(fd, &st) < 0 ||
+      !S_ISREG(st.st_mode))
+    return fd;
+  struct handle *h = malloc(sizeof(struct handle));
+  h->fd = fd;
+  h->flags = flags;
+  h->dev = st.st_dev;
+  h->ino = st.st_ino;
+  h->path = strdup(pathname);
+  open_handles[fd] = h;
+  return fd;
+}
+
+// Closes a client fd, keeping tracked read-only handles in the cache.
+int close_cached(int fd) {
+  if (fd >= 0 && fd < MAX_TRACKED_FD && open_handles[fd]) {
+    cache_handle(open_handles[fd]);
+    open_handles[fd] = NULL;
+    errno = 0;
+    return 0;
+  }
+  return close(fd);
+}
+
+// Copies the content of `in` to the file offset of `out` with
+// copy_file_range(), falling back to sendfile() where that is not supported.
+// The file offset of `in` is left alone. Returns the bytes copied, or -1.
+off_t copy_fd(int in, int out) {
+  off_t copied = 0, in_off = 0;
+  int use_sendfile = 0;
+  while (1) {
+    ssize_t n;
+    if (!use_sendfile)
+      n = copy_file_range(in, &in_off, out, NULL, COPY_CHUNK, 0);
+    else
+      n = sendfile(out, in, &in_off, COPY_CHUNK);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && !use_sendfile && copied == 0 &&
+        (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP ||
+         errno == EINVAL)) {
+      use_sendfile = 1;
+      continue;
+    }
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      return copied;
+    copied += n;
+  }
+}
+
+// Copies `src` to `dst` (created or truncated, with the mode of `src`) with a
+// reflink if the filesystem can share the blocks, else with copy_fd().
+off_t copy_file(const char *src, const char *dst) {
+  struct stat st, dst_st;
+  int in = open(src, O_RDONLY);
+  if (in < 0)
+    return -1;
+  int ok = fstat(in, &st) == 0;
+  if (ok && !S_ISREG(st.st_mode)) {
+    errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+    ok = 0;
+  }
+  if (!ok) {
+    close(in);
+    return -1;
+  }
+  // opening with O_TRUNC would destroy the source if both name the same file
+  if (stat(dst, &dst_st) == 0 && dst_st.st_dev == st.st_dev &&
+      dst_st.st_ino == st.st_ino) {
+    close(in);
+    errno = EINVAL;
+    return -1;
+  }
+  int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+  if (out < 0) {
+    close(in);
+    return -1;
+  }
+
+  off_t copied = ioctl(out, FICLONE, in) == 0 ? st.st_size : copy_fd(in, out);
+  close(in);
+  if (close(out) < 0)
+    copied = -1;
+  else if (copied >= 0)
+    errno = 0;
+  return copied;
+}
+
+static void rmtree_add(struct rmtree_list *l, const char *path) {
+  if (l->len == l->cap) {
+    l->cap = l->cap ? 2 * l->cap : 256;
+    l->paths = realloc(l->paths, l->cap * sizeof(char *));
+  }
+  l->paths[l->len++] = strdup(path);
+}
+
+static int rmtree_collect(const char *path, const struct stat *st, int type,
+                          struct FTW *ftw) {
+  (void)st;
+  (void)ftw;
+  if (type == FTW_DP)
+    rmtree_add(&rm_dirs, path);
+  else if (type == FTW_DNR || type == FTW_NS)
+    __atomic_store_n(&rm_err, EACCES, __ATOMIC_RELAXED);
+  else
+    rmtree_add(&rm_files, path);
+  return 0;
+}
+
+static void *rmtree_worker(void *arg) {
+  (void)arg;
+  size_t i;
+  while ((i = __atomic_fetch_add(&rm_next, 1, __ATOMIC_RELAXED)) <
+         rm_files.len) {
+    if (unlink(rm_files.paths[i]) == 0)
+      __atomic_fetch_add(&rm_removed, 1, __ATOMIC_RELAXED);
+    else
+      __atomic_store_n(&rm_err, errno, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+// Removes `path` and everything below it, without following symlinks.
+// Returns the number of entries removed, or -1 with errno of the last failure
+// if anything could not be removed.
+ssize_t rmtree(const char *path) {
+  // the handle cache may hold files of the tree open
+  while (nhandles > 0)
+    drop_cached_handle(0);
+
+  rm_files.len = rm_dirs.len = 0;
+  rm_next = 0;
+  rm_err = 0;
+  rm_removed = 0;
+  if (nftw(path, rmtree_collect, 64, FTW_DEPTH | FTW_PHYS) < 0)
+    return -1;
+
+  int nthreads = rm_files.len < RMTREE_THREADS ? rm_files.len : RMTREE_THREADS;
+  pthread_t threads[RMTREE_THREADS];
+  int started = 0;
+  while (started < nthreads &&
+         pthread_create(&threads[started], NULL, rmtree_worker, NULL) == 0)
+    started++;
+  rmtree_worker(NULL); // also does all the work if no thread could start
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  for (size_t i = 0; i < rm_dirs.len; i++) {
+    if (rmdir(rm_dirs.paths[i]) == 0)
+      rm_removed++;
+    else
+      rm_err = errno;
+  }
+
+  for (size_t i = 0; i < rm_files.len; i++)
+    free(rm_files.paths[i]);
+  for (size_t i = 0; i < rm_dirs.len; i++)
+    free(rm_dirs.paths[i]);
+  errno = rm_err;
+  return rm_err ? -1 : rm_removed;
+}
+
+void session_enter(int meta) {
+  pthread_mutex_lock(&session_lock);
+  if (meta) {
+    meta_waiting++;
+    while (session_busy)
+      pthread_cond_wait(&session_cond, &session_lock);
+    meta_waiting--;
+  } else {
+    while (session_busy || meta_waiting)
+      pthread_cond_wait(&session_cond, &session_lock);
+  }
+  session_busy = 1;
+  session_held = 1;
+  pthread_mutex_unlock(&session_lock);
+}
+
+// Gives up the turn, if this thread still has it.
+void session_leave() {
+  if (!session_held)
+    return;
+  session_held = 0;
+  pthread_mutex_lock(&session_lock);
+  session_busy = 0;
+  pthread_cond_broadcast(&session_cond);
+  pthread_mutex_unlock(&session_lock);
+}
+
+// Abstract unix socket address where the session that issued `token` waits
+// for its metadata channel.
+socklen_t meta_addr(struct sockaddr_un *addr, uint64_t token) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  int n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                   "rfs15440.%016llx", (unsigned long long)token);
+  return offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+void serve(int sessfd, int meta);
+
+// Waits on `lfd` for the process that accepted a channel of this session to
+// pass it over, and returns it, or -1.
+int accept_channel(int lfd) {
+  int conn = accept(lfd, NULL, NULL);
+  close(lfd);
+  if (conn < 0)
+    return -1;
+
+  char byte;
+  char ctrl[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {&byte, 1};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = ctrl,
+                       .msg_controllen = sizeof(ctrl)};
+  ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  close(conn);
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  if (n != 1 || c == NULL || c->cmsg_type != SCM_RIGHTS)
+    return -1;
+  int fd;
+  memcpy(&fd, CMSG_DATA(c), sizeof(int));
+  response res = {.res.close.ret_val = 0};
+  send_response(fd, ATTACH, &res, NULL, 0);
+  return fd;
+}
+
+// Serves the metadata channel once it is attached.
+void *meta_main(void *arg) {
+  int sessfd = accept_channel((int)(intptr_t)arg);
+  if (sessfd >= 0)
+    serve(sessfd, 1);
+  return NULL;
+}
+
+// Starts waiting for a channel of this session on a thread running `main`
+// with the listening socket; returns the token the client must attach the
+// channel with, or 0 if that failed.
+uint64_t open_channel(void *(*main)(void *)) {
+  uint64_t token;
+  if (getrandom(&token, sizeof(token), 0) != sizeof(token) || token == 0)
+    return 0;
+  struct sockaddr_un addr;
+  socklen_t len = meta_addr(&addr, token);
+  int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (lfd < 0)
+    return 0;
+  pthread_t thread;
+  if (bind(lfd, (struct sockaddr *)&addr, len) < 0 || listen(lfd, 1) < 0 ||
+      pthread_create(&thread, NULL, main, (void *)(intptr_t)lfd) != 0) {
+    close(lfd);
+    return 0;
+  }
+  pthread_detach(thread);
+  return token;
+}
+
+// Passes this connection to the session waiting for it under `token`.
+// Returns -1 if there is no such session.
+int attach_channel(int sessfd, uint64_t token) {
+  struct sockaddr_un addr;
+  socklen_t len = meta_addr(&addr, token);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&addr, len) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  char byte = 0;
+  char ctrl[CMSG_SPACE(sizeof(int))] = {0};
+  struct iovec iov = {&byte, 1};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = ctrl,
+                       .msg_controllen = sizeof(ctrl)};
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(c), &sessfd, sizeof(int));
+  ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  close(fd);
+  return n == 1 ? 0 : -1;
+}
+
+// Maps `size` bytes of zeroed memory shared with the processes forked later.
+void *shared_alloc(size_t size) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                 -1, 0);
+  if (p == MAP_FAILED)
+    err(1, 0);
+  return p;
+}
+
+void shared_mutex_init(pthread_mutex_t *m) {
+  pthread_mutexattr_t ma;
+  pthread_mutexattr_init(&ma);
+  pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(m, &ma);
+}
+
+// Timed waits on the condition use CLOCK_MONOTONIC.
+void shared_cond_init(pthread_cond_t *c) {
+  pthread_condattr_t ca;
+  pthread_condattr_init(&ca);
+  pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+  pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+  pthread_cond_init(c, &ca);
+}
+
+void shared_lock(pthread_mutex_t *m) {
+  // a session that died holding the lock leaves it consistent: every update
+  // under the lock is completed before anything can fail
+  if (pthread_mutex_lock(m) == EOWNERDEAD)
+    pthread_mutex_consistent(m);
+}
+
+void sched_init() {
+  sched = shared_alloc(sizeof(struct scheduler));
+  shared_mutex_init(&sched->lock);
+  shared_cond_init(&sched->cond);
+
+  char *budget = getenv("budget15440");
+  sched->budget = budget ? strtoul(budget, NULL, 10) : INFLIGHT_BUDGET;
+}
+
+void sched_lock() { shared_lock(&sched->lock); }
+
+// Returns a free client entry, with `id` and one session. Called with the
+// lock held.
+int sched_new_client(uint64_t id) {
+  for (int c = 0; c < sched->used; c++) {
+    struct sched_client *cl = &sched->clients[c];
+    if (cl->sessions == 0) {
+      *cl = (struct sched_client){.id = id, .sessions = 1};
+      return c;
+    }
+  }
+  errx(1, "[server.c]: out of scheduler clients");
+}
+
+// Takes a session out of client `c`, freeing the entry with the last one.
+// Called with the lock held.
+void sched_leave_client(int c) {
+  if (--sched->clients[c].sessions == 0)
+    memset(&sched->clients[c], 0, sizeof(struct sched_client));
+}
+
+// The session of client `c` that has waited longest for admission, or -1.
+// Called with the lock held.
+int sched_head(int c) {
+  int head = -1;
+  for (int i = 0; i < sched->used; i++) {
+    struct sched_slot *s = &sched->slots[i];
+    if (s->pid && s->client == c && s->waiting && !s->granted &&
+        (head < 0 || s->ticket < sched->slots[head].ticket))
+      head = i;
+  }
+  return head;
+}
+
+// Deficit round robin over the clients with sessions waiting for admission.
+// Each visit to a client adds a quantum to its deficit; the request of its
+// longest waiting session is admitted once the deficit covers the cost and
+// the in-flight budget has room. A request larger than the whole budget is
+// admitted when nothing else is in flight. Called with the lock held.
+void sched_grant() {
+  int head[MAX_SESSIONS];
+  for (int c = 0; c < sched->used; c++)
+    head[c] = -1;
+  for (int i = 0; i < sched->used; i++) {
+    struct sched_slot *s = &sched->slots[i];
+    int *h = &head[s->client];
+    if (s->pid && s->waiting && !s->granted &&
+        (*h < 0 || s->ticket < sched->slots[*h].ticket))
+      *h = i;
+  }
+
+  while (1) {
+    int waiting = 0;
+    for (int n = 0; n < sched->used; n++) {
+      int c = (sched->next + n) % sched->used;
+      if (head[c] < 0)
+        continue;
+      struct sched_client *cl = &sched->clients[c];
+      struct sched_slot *s = &sched->slots[head[c]];
+      waiting = 1;
+      if (cl->deficit < s->want) {
+        cl->deficit += DRR_QUANTUM;
+        continue;
+      }
+      if (sched->inflight > 0 && sched->inflight + s->want > sched->budget) {
+        // keep its turn so small requests can't starve it
+        sched->next = c;
+        return;
+      }
+      s->granted = 1;
+      cl->deficit -= s->want;
+      s->held += s->want;
+      sched->inflight += s->want;
+      sched->next = (c + 1) % sched->used;
+      head[c] = sched_head(c);
+      break;
+    }
+    if (!waiting)
+      return;
+  }
+}
+
+// Blocks until a bulk request costing `cost` bytes may run. While a session
+// waits here it stops reading its socket, so TCP flow control pushes back on
+// the client.
+void sched_admit(size_t cost) {
+  struct sched_slot *s = &sched->slots[my_slot];
+  sched_lock();
+  s->want = cost;
+  s->granted = 0;
+  s->waiting = 1;
+  s->ticket = ++sched->tickets;
+  sched_grant();
+  pthread_cond_broadcast(&sched->cond);
+  while (!s->granted)
+    pthread_cond_wait(&sched->cond, &sched->lock);
+  s->waiting = 0;
+  pthread_mutex_unlock(&sched->lock);
+}
+
+void sched_release(size_t cost) {
+  struct sched_slot *s = &sched->slots[my_slot];
+  sched_lock();
+  s->held -= cost;
+  sched->inflight -= cost;
+  sched_grant();
+  pthread_cond_broadcast(&sched->cond);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+void lease_drop_slot(int slot);
+
+// Moves this session to the client named `id` in OPTIONS: into the entry of
+// other sessions with the same id, or its own entry if there are none.
+void sched_join(uint64_t id) {
+  struct sched_slot *s = &sched->slots[my_slot];
+  sched_lock();
+  if (id != sched->clients[s->client].id) {
+    int c = 0;
+    while (c < sched->used && (sched->clients[c].sessions == 0 ||
+                               sched->clients[c].id != id || id == 0))
+      c++;
+    sched_leave_client(s->client);
+    if (c < sched->used) {
+      sched->clients[c].sessions++;
+      s->client = c;
+    } else {
+      s->client = sched_new_client(id);
+    }
+  }
+  pthread_mutex_unlock(&sched->lock);
+}
+
+// Frees the slot of a session process that exited, returning any budget it
+// still held, and its leases.
+void sched_drop(pid_t pid) {
+  sched_lock();
+  for (int i = 0; i < sched->used; i++) {
+    struct sched_slot *s = &sched->slots[i];
+    if (s->pid != pid)
+      continue;
+    sched->inflight -= s->held;
+    sched_leave_client(s->client);
+    memset(s, 0, sizeof(struct sched_slot));
+    lease_drop_slot(i);
+    sched_grant();
+    pthread_cond_broadcast(&sched->cond);
+    break;
+  }
+  pthread_mutex_unlock(&sched->lock);
+}
+
+// Reaps finished sessions and reserves a free slot, in a client entry of its
+// own until the session names its client. While MAX_SESSIONS are active this
+// blocks, leaving new connections in the listen backlog.
+int sched_reserve_slot() {
+  pid_t pid;
+  while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+    sched_drop(pid);
+  while (1) {
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+      struct sched_slot *s = &sched->slots[i];
+      if (s->pid != 0)
+        continue;
+      sched_lock();
+      if (i >= sched->used)
+        sched->used = i + 1;
+      s->pid = -1;
+      s->client = sched_new_client(0);
+      pthread_mutex_unlock(&sched->lock);
+      return i;
+    }
+    if ((pid = waitpid(-1, NULL, 0)) > 0)
+      sched_drop(pid);
+  }
+}
+
+static long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void leases_init() {
+  leases = shared_alloc(sizeof(struct lease_table));
+  shared_mutex_init(&leases->lock);
+  shared_cond_init(&leases->cond);
+  shared_cond_init(&leases->recall_cond);
+  char *term = getenv("leaseterm15440");
+  leases->term = (term ? atol(term) : LEASE_TERM_MS) * 1000000L;
+}
+
+static struct lease_bucket *lease_bucket(dev_t dev, ino_t ino) {
+  return &leases->buckets[(ino * 31 + dev) % LEASE_BUCKETS];
+}
+
+static struct lease *lease_entry(uint64_t id) {
+  size_t index = id & ((1 << LEASE_INDEX_BITS) - 1);
+  struct lease *l =
+      &leases->buckets[index / LEASE_WAYS].ways[index % LEASE_WAYS];
+  return l->id == id ? l : NULL;
+}
+
+// Called with the lock held, like everything below that touches the table.
+static void lease_free(struct lease *l) {
+  if (l->recall == 1)
+    leases->recalls[l->slot]--;
+  memset(l, 0, sizeof(struct lease));
+  pthread_cond_broadcast(&leases->cond);
+}
+
+static void lease_wait(long until) {
+  struct timespec ts = {until / 1000000000L, until % 1000000000L};
+  pthread_cond_timedwait(&leases->cond, &leases->lock, &ts);
+}
+
+// Recalls the leases other sessions hold on the inode of `st`, or on
+// anything if it is NULL, that conflict with `mode`, and waits until they
+// are returned or have expired. Read leases only conflict with writes. For
+// a `change`, this session's read leases are recalled too, since the client
+// may cache the file under other names; its write delegation is not.
+static void lease_recall_wait(const struct stat *st, int mode, int change) {
+  while (1) {
+    long now = now_ns(), until = 0;
+    int recalled = 0;
+    struct lease_bucket *b = leases->buckets, *end = b + LEASE_BUCKETS;
+    if (st) {
+      b = lease_bucket(st->st_dev, st->st_ino);
+      end = b + 1;
+    }
+    for (; b < end; b++) {
+      for (int w = 0; w < LEASE_WAYS; w++) {
+        struct lease *l = &b->ways[w];
+        if (!l->id)
+          continue;
+        if (l->expires <= now) {
+          lease_free(l);
+          continue;
+        }
+        if ((l->slot == my_slot && (!change || l->mode == LEASE_WRITE)) ||
+            (st && (l->dev != st->st_dev || l->ino != st->st_ino)) ||
+            (mode == LEASE_READ && l->mode == LEASE_READ))
+          continue;
+        if (!l->recall) {
+          l->recall = 1;
+          leases->recalls[l->slot]++;
+          recalled = 1;
+        }
+        if (l->expires > until)
+          until = l->expires;
+      }
+    }
+    if (recalled)
+      pthread_cond_broadcast(&leases->recall_cond);
+    if (!until)
+      return;
+    lease_wait(until);
+  }
+}
+
+// Grants this session a lease of `*mode` on the inode of `st` once no change
+// to it is in progress, recalling conflicting leases of other sessions
+// first. Returns its id, or 0 if the inode's bucket is full; `*mode` is set
+// to the mode of the lease, which a renewed one may exceed.
+uint64_t lease_grant(const struct stat *st, int *mode) {
+  struct lease_bucket *b = lease_bucket(st->st_dev, st->st_ino);
+  shared_lock(&leases->lock);
+  while (1) {
+    while (b->busy || leases->busy_all)
+      lease_wait(now_ns() + leases->term);
+    lease_recall_wait(st, *mode, 0);
+    if (!b->busy && !leases->busy_all)
+      break;
+  }
+
+  // renew a lease the session already holds, unless it is being recalled
+  struct lease *l = NULL;
+  for (int w = 0; w < LEASE_WAYS && !l; w++) {
+    struct lease *o = &b->ways[w];
+    if (o->id && o->slot == my_slot && o->dev == st->st_dev &&
+        o->ino == st->st_ino && !o->recall)
+      l = o;
+  }
+  for (int w = 0; w < LEASE_WAYS && !l; w++) {
+    if (!b->ways[w].id) {
+      l = &b->ways[w];
+      size_t index = (b - leases->buckets) * LEASE_WAYS + w;
+      *l = (struct lease){.id = ++leases->next_id << LEASE_INDEX_BITS | index,
+                          .dev = st->st_dev,
+                          .ino = st->st_ino,
+                          .slot = my_slot};
+    }
+  }
+  uint64_t id = 0;
+  if (l) {
+    if (*mode > l->mode)
+      l->mode = *mode;
+    *mode = l->mode;
+    l->expires = now_ns() + leases->term;
+    id = l->id;
+  }
+  pthread_mutex_unlock(&leases->lock);
+  return id;
+}
+
+// Frees lease `id` of this session, given back by its client.
+void lease_return(uint64_t id) {
+  shared_lock(&leases->lock);
+  struct lease *l = lease_entry(id);
+  if (l && l->slot == my_slot)
+    lease_free(l);
+  pthread_mutex_unlock(&leases->lock);
+}
+
+// Frees all leases of the session in `slot`, which ended.
+void lease_drop_slot(int slot) {
+  shared_lock(&leases->lock);
+  for (int i = 0; i < LEASE_BUCKETS; i++)
+    for (int w = 0; w < LEASE_WAYS; w++)
+      if (leases->buckets[i].ways[w].id &&
+          leases->buckets[i].ways[w].slot == slot)
+        lease_free(&leases->buckets[i].ways[w]);
+  leases->recalls[slot] = 0;
+  pthread_mutex_unlock(&leases->lock);
+}
+
+// Adds what `path` names to `c`, as selected by CHANGE_* `what`.
+void change_path(struct change *c, const char *path, int what) {
+  int exists = stat(path, &c->st[c->n]) == 0;
+  if (exists && (what & CHANGE_FILE))
+    c->n++;
+  if ((what & CHANGE_ENTRY) || (!exists && (what & CHANGE_CREATE))) {
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    size_t len = slash ? (size_t)(slash - path) : 0;
+    if (len >= sizeof(dir))
+      return;
+    memcpy(dir, path, len);
+    strcpy(dir + len, slash == path ? "/" : len ? "" : ".");
+    if (stat(dir, &c->st[c->n]) == 0)
+      c->n++;
+  }
+}
+
+// Adds the nearest existing ancestor of missing `path` to `c`: nothing can
+// appear at the path without changing it.
+void change_ancestor(struct change *c, const char *path) {
+  char dir[PATH_MAX];
+  if (strlen(path) >= sizeof(dir))
+    return;
+  strcpy(dir, path);
+  while (1) {
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL)
+      strcpy(dir, ".");
+    else if (slash == dir)
+      dir[1] = '\0';
+    else
+      *slash = '\0';
+    if (stat(dir, &c->st[c->n]) == 0) {
+      c->n++;
+      return;
+    }
+    if (errno != ENOENT || !strcmp(dir, ".") || !strcmp(dir, "/"))
+      return;
+  }
+}
+
+void change_fd(struct change *c, int fd) {
+  if (fstat(fd, &c->st[c->n]) == 0)
+    c->n++;
+}
+
+// Recalls the leases on what `c` changes and holds back new grants on it
+// until lease_end(). Keeps errno.
+void lease_begin(struct change *c) {
+  // before any session asked for leases there is nothing to recall
+  if (!__atomic_load_n(&leases->enabled, __ATOMIC_ACQUIRE) ||
+      (!c->all && !c->n))
+    return;
+  int saved = errno;
+  shared_lock(&leases->lock);
+  if (c->all) {
+    leases->busy_all++;
+    lease_recall_wait(NULL, LEASE_WRITE, 1);
+  }
+  for (int i = 0; i < c->n; i++) {
+    lease_bucket(c->st[i].st_dev, c->st[i].st_ino)->busy++;
+    lease_recall_wait(&c->st[i], LEASE_WRITE, 1);
+  }
+  pthread_mutex_unlock(&leases->lock);
+  errno = saved;
+}
+
+void lease_end(struct change *c) {
+  if (!__atomic_load_n(&leases->enabled, __ATOMIC_ACQUIRE) ||
+      (!c->all && !c->n))
+    return;
+  int saved = errno;
+  shared_lock(&leases->lock);
+  leases->busy_all -= c->all;
+  for (int i = 0; i < c->n; i++)
+    lease_bucket(c->st[i].st_dev, c->st[i].st_ino)->busy--;
+  pthread_cond_broadcast(&leases->cond);
+  pthread_mutex_unlock(&leases->lock);
+  errno = saved;
+}
+
+// What `req` changes, for lease_begin().
+void request_changes(request *req, struct change *c) {
+  switch (req->header.opcode) {
+  case OPEN:
+    if (req->req.open.flags & (O_CREAT | O_TRUNC))
+      change_path(c, req->req.open.pathname,
+                  (req->req.open.flags & O_TRUNC ? CHANGE_FILE : 0) |
+                      (req->req.open.flags & O_CREAT ? CHANGE_CREATE : 0));
+    break;
+  case WRITE:
+    change_fd(c, req->req.write.fd);
+    break;
+  case DELTA:
+    change_fd(c, req->req.delta.fd);
+    break;
+  case UNLINK:
+    change_path(c, req->req.unlink.pathname, CHANGE_FILE | CHANGE_ENTRY);
+    break;
+  case COPY: {
+    copy_req *cr = &req->req.copy;
+    size_t paths_len = sizeof(req_header) + req->header.payload_len -
+                       offsetof(request, req.copy.paths);
+    if (cr->src_len > 0 && cr->src_len < paths_len)
+      change_path(c, cr->paths + cr->src_len, CHANGE_FILE | CHANGE_CREATE);
+    break;
+  }
+  case RMTREE:
+    c->all = 1;
+    break;
+  default:
+    break;
+  }
+}
+
+// Answers LEASE: the attributes of the path, and a lease on it, or on its
+// nearest existing ancestor directory if it does not exist. The attributes
+// are taken again once the lease is granted, so no change it does not cover
+// can come in between.
+void lease_path(lease_req *lr, int sessfd) {
+  response res = {0};
+  lease_res *lres = &res.res.lease;
+  for (int tries = 0; tries < 3; tries++) {
+    lres->ret_val = stat(lr->pathname, &lres->statbuf);
+    res.header.errno_value = errno;
+    if (callback_fd < 0)
+      break;
+    struct change c = {0};
+    int mode = LEASE_READ;
+    if (lres->ret_val == 0) {
+      c.st[c.n++] = lres->statbuf;
+      if (S_ISREG(lres->statbuf.st_mode) && lr->mode == LEASE_WRITE)
+        mode = LEASE_WRITE;
+    } else if (errno == ENOENT) {
+      change_ancestor(&c, lr->pathname);
+    }
+    if (c.n == 0 || (lres->lease = lease_grant(&c.st[0], &mode)) == 0)
+      break;
+
+    struct stat st;
+    int ret = stat(lr->pathname, &st);
+    int same = ret < 0 ? errno == ENOENT
+                       : st.st_dev == c.st[0].st_dev &&
+                             st.st_ino == c.st[0].st_ino;
+    if (ret == lres->ret_val && same) {
+      if (ret == 0)
+        lres->statbuf = st;
+      lres->mode = mode;
+      lres->term_ms = leases->term / 1000000L;
+      break;
+    }
+    lease_return(lres->lease);
+    lres->lease = 0;
+  }
+  send_response(sessfd, LEASE, &res, NULL, 0);
+}
+
+// Sends RECALLs of this session's leases on the callback channel as other
+// sessions ask for them.
+void *recall_main(void *arg) {
+  (void)arg;
+  shared_lock(&leases->lock);
+  while (1) {
+    while (leases->recalls[my_slot] == 0)
+      pthread_cond_wait(&leases->recall_cond, &leases->lock);
+    uint64_t ids[RECALL_BATCH];
+    int n = 0;
+    for (int i = 0; i < LEASE_BUCKETS && n < RECALL_BATCH; i++) {
+      for (int w = 0; w < LEASE_WAYS && n < RECALL_BATCH; w++) {
+        struct lease *l = &leases->buckets[i].ways[w];
+        if (l->id && l->slot == my_slot && l->recall == 1) {
+          l->recall = 2;
+          leases->recalls[my_slot]--;
+          ids[n++] = l->id;
+        }
+      }
+    }
+    pthread_mutex_unlock(&leases->lock);
+    for (int i = 0; i < n; i++) {
+      response res = {.res.recall.lease = ids[i]};
+      send_response(callback_fd, RECALL, &res, NULL, 0);
+    }
+    shared_lock(&leases->lock);
+  }
+  return NULL;
+}
+
+// Runs the callback channel once it is attached: RECALLs go out from
+// recall_main(), and the RELEASEs that answer them come in here.
+void *callback_main(void *arg) {
+  int fd = accept_channel((int)(intptr_t)arg);
+  if (fd < 0)
+    return NULL;
+  callback_fd = fd;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, recall_main, NULL) != 0) {
+    callback_fd = -1;
+    return NULL;
+  }
+  pthread_detach(thread);
+  request *req = malloc(MAXMSGLEN + 1);
+  while (get_request(req, fd) == 0)
+    if (req->header.opcode == RELEASE)
+      lease_return(req->req.release.lease);
+  free(req);
+  return NULL;
+}
+
+// Bytes of disk and memory a request may tie up. Requests below
+// SMALL_OP_COST, which covers all metadata operations, bypass the scheduler
+// so their latency does not depend on bulk load.
+size_t request_cost(request *req) {
+  size_t cost;
+  switch (req->header.opcode) {
+  case READ:
+    cost = req->req.read.nbyte;
+    break;
+  case PREAD:
+    cost = req->req.pread.nbyte;
+    break;
+  case GETDIRENTRIES:
+  case READDIRPLUS:
+    cost = req->req.direntries.nbytes;
+    break;
+  case GETDIRTREE:
+  case RMTREE:
+    cost = DIRTREE_COST;
+    break;
+  case COPY:
+    cost = COPY_COST;
+    break;
+  case CHECKSUMS:
+    cost = req->req.checksums.len;
+    break;
+  case WRITE:
+  case DELTA:
+    cost = req->header.payload_len;
+    break;
+  default:
+    return 0;
+  }
+  if (cost > MAXMSGLEN)
+    cost = MAXMSGLEN;
+  return cost < SMALL_OP_COST ? 0 : cost;
+}
+
+// Reads queued ranges so they are in the page cache by the time the client
+// asks for them. Plain reads work on any file system, including those that
+// ignore POSIX_FADV_WILLNEED.
+void *prefetch_main(void *arg) {
+  char *buf = malloc(PREFETCH_CHUNK);
+  while (1) {
+    pthread_mutex_lock(&prefetch_lock);
+    while (prefetch_len == 0)
+      pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+    struct prefetch_job job = prefetch_queue[prefetch_head];
+    prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE;
+    prefetch_len--;
+    pthread_mutex_unlock(&prefetch_lock);
+
+    off_t end = job.off + job.len;
+    for (off_t off = job.off; off < end;) {
+      size_t len = end - off < PREFETCH_CHUNK ? end - off : PREFETCH_CHUNK;
+      ssize_t n = pread(job.fd, buf, len, off);
+      if (n <= 0)
+        break;
+      off += n;
+    }
+    close(job.fd);
+  }
+  return NULL;
+}
+
+// Queues a range for the prefetch thread, starting it on first use. A full
+// queue drops the range; it is only a hint.
+void prefetch(int fd, off_t off, size_t len) {
+  if (!prefetch_started) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, prefetch_main, NULL) != 0)
+      return;
+    pthread_detach(tid);
+    prefetch_started = 1;
+  }
+  pthread_mutex_lock(&prefetch_lock);
+  if (prefetch_len < PREFETCH_QUEUE) {
+    int job_fd = dup(fd);
+    if (job_fd >= 0) {
+      prefetch_queue[(prefetch_head + prefetch_len) % PREFETCH_QUEUE] =
+          (struct prefetch_job){job_fd, off, len};
+      prefetch_len++;
+      pthread_cond_signal(&prefetch_cond);
+    }
+  }
+  pthread_mutex_unlock(&prefetch_lock);
+}
+
+// Forgets the access pattern of an fd handed out by OPEN.
+void readahead_reset(int fd) {
+  if (fd < 0 || fd >= MAX_TRACKED_FD)
+    return;
+  if (ra[fd].random)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_NORMAL);
+  memset(&ra[fd], 0, sizeof(struct readahead));
+}
+
+// Called before reading `nbyte` bytes at `off`: classifies the read and, for
+// a stream, keeps data beyond it in flight (at least half a window of it when
+// the reads are contiguous), so disk reads overlap with sending this response.
+void readahead_hint(int fd, off_t off, size_t nbyte) {
+  if (fd < 0 || fd >= MAX_TRACKED_FD || off < 0)
+    return;
+  struct readahead *r = &ra[fd];
+  int contiguous = off == r->next;
+  if (r->seq > 0 && off < r->next) {
+    // a backward seek: the reads are scattered
+    if (!r->random)
+      posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+    r->random = 1;
+  }
+  if (r->seq == 0 || off < r->next ||
+      (!contiguous && r->seq > 1 && off - r->last != r->stride)) {
+    r->seq = 1;
+    r->window = 0;
+    r->ahead = 0;
+    r->last = off;
+    return;
+  }
+  r->stride = off - r->last;
+  r->last = off;
+  if (++r->seq < RA_SEQ_READS)
+    return;
+  if (r->random) {
+    posix_fadvise(fd, 0, 0,
+                  contiguous ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_NORMAL);
+    r->random = 0;
+  }
+
+  off_t end = off + nbyte;
+  if (!contiguous) {
+    // the other connections of a striped read fetch the bytes in between,
+    // so only this connection's next range is worth reading ahead
+    if (r->ahead >= end + r->stride)
+      return;
+    posix_fadvise(fd, off + r->stride, nbyte, POSIX_FADV_WILLNEED);
+    prefetch(fd, off + r->stride, nbyte);
+    r->ahead = end + r->stride;
+    return;
+  }
+  if (r->window == 0)
+    r->window = RA_MIN_WINDOW;
+  if (r->ahead < end)
+    r->ahead = end;
+  if (r->ahead - end >= (off_t)r->window / 2)
+    return;
+  posix_fadvise(fd, r->ahead, r->window, POSIX_FADV_WILLNEED);
+  prefetch(fd, r->ahead, r->window);
+  r->ahead += r->window;
+  if (r->window < RA_MAX_WINDOW)
+    r->window *= 2;
+}
+
+// Reads like read(), or pread() at `offset` if it is not negative, in
+// CRC_CHUNK pieces that are checksummed into `sum` while the kernel's copy of
+// them is still in cache.
+ssize_t read_summed(int fd, char *buf, size_t nbyte, off_t offset,
+                    uint32_t *sum) {
+  size_t done = 0;
+  while (done < nbyte) {
+    size_t chunk = nbyte - done < CRC_CHUNK ? nbyte - done : CRC_CHUNK;
+    ssize_t n = offset < 0 ? read(fd, buf + done, chunk)
+                           : pread(fd, buf + done, chunk, offset + done);
+    if (n < 0) {
+      if (done == 0)
+        return -1;
+      break;
+    }
+    *sum = crc32c(*sum, buf + done, n);
+    done += n;
+    if ((size_t)n < chunk)
+      break;
+  }
+  return done;
+}
+
+// Finds the holes of at least SPARSE_MIN_HOLE bytes among the `len` bytes at
+// `pos` of fd, which must lie within the file, with SEEK_DATA/SEEK_HOLE.
+// Stores up to SPARSE_MAX_HOLES of them relative to `pos` and returns how
+// many; the fd offset is left where it was.
+int find_holes(int fd, off_t pos, size_t len, read_hole *holes) {
+  off_t cur = lseek(fd, 0, SEEK_CUR);
+  off_t off = pos, end = pos + len;
+  int n = 0;
+  while (off < end && n < SPARSE_MAX_HOLES) {
+    off_t data = lseek(fd, off, SEEK_DATA);
+    if (data < 0 && errno != ENXIO) // ENXIO: a hole up to the end of file
+      break;
+    if (data < 0 || data > end)
+      data = end;
+    if (data - off >= SPARSE_MIN_HOLE)
+      holes[n++] = (read_hole){off - pos, data - off};
+    if (data == end)
+      break;
+    off = lseek(fd, data, SEEK_HOLE);
+    if (off < 0)
+      break;
+  }
+  lseek(fd, cur, SEEK_SET);
+  return n;
+}
+
+// Reads up to `nbyte` bytes at `pos` of a sparse file into buf, leaving out
+// its holes, which are stored in `holes`. Returns the number of file bytes
+// covered and sets *nholes and *data_len, the bytes put into buf; returns -1
+// if the range has no holes worth leaving out or the file changed under it,
+// for the caller to read it in full. With `sum`, the data is added to that
+// CRC32C piece by piece as it is read.
+ssize_t read_sparse(int fd, char *buf, size_t nbyte, off_t pos,
+                    read_hole *holes, int *nholes, size_t *data_len,
+                    uint32_t *sum) {
+  struct stat st;
+  // fully allocated files have no holes, so don't look for them
+  if (nbyte < SPARSE_MIN_HOLE || fstat(fd, &st) < 0 ||
+      !S_ISREG(st.st_mode) || st.st_blocks * 512 >= st.st_size ||
+      pos >= st.st_size)
+    return -1;
+  size_t len = st.st_size - pos < (off_t)nbyte ? st.st_size - pos : nbyte;
+  *nholes = find_holes(fd, pos, len, holes);
+  if (*nholes == 0)
+    return -1;
+
+  size_t done = 0, off = 0;
+  for (int i = 0; i <= *nholes; i++) {
+    size_t end = i < *nholes ? holes[i].off : len;
+    while (off < end) {
+      size_t chunk = end - off < CRC_CHUNK ? end - off : CRC_CHUNK;
+      ssize_t n = pread(fd, buf + done, chunk, pos + off);
+      if (n <= 0)
+        return -1;
+      if (sum)
+        *sum = crc32c(*sum, buf + done, n);
+      done += n;
+      off += n;
+    }
+    if (i < *nholes)
+      off += holes[i].len;
+  }
+  *data_len = done;
+  return len;
+}
+
+// Reads up to `nbyte` bytes at the fd offset, or at `offset` if it is not
+// negative, and sends them right after the read_res fields so the client can
+// receive them into the caller's buffer. With FEAT_SPARSE, holes of sparse
+// files are sent as read_hole entries after the data instead.
+void read_file(int fd, size_t nbyte, off_t offset, int sessfd) {
+  if (nbyte > MAXMSGLEN)
+    nbyte = MAXMSGLEN;
+  char *read_buf = malloc(nbyte);
+  response read_response;
+  off_t pos = offset < 0 ? lseek(fd, 0, SEEK_CUR) : offset;
+  readahead_hint(fd, pos, nbyte);
+  uint32_t sum = 0;
+  read_hole holes[SPARSE_MAX_HOLES];
+  int nholes = 0;
+  size_t data_len = 0;
+  ssize_t sparse = -1;
+  uint32_t *data_sum = session_features & FEAT_CRC32C ? &sum : NULL;
+  if ((session_features & FEAT_SPARSE) && pos >= 0)
+    sparse = read_sparse(fd, read_buf, nbyte, pos, holes, &nholes, &data_len,
+                         data_sum);
+  if (sparse >= 0) {
+    read_response.res.read.nbyte = sparse;
+    if (offset < 0)
+      lseek(fd, pos + sparse, SEEK_SET);
+  } else {
+    sum = 0;
+    nholes = 0;
+    if (session_features & FEAT_CRC32C)
+      read_response.res.read.nbyte =
+          read_summed(fd, read_buf, nbyte, offset, &sum);
+    else if (offset < 0)
+      read_response.res.read.nbyte = read(fd, read_buf, nbyte);
+    else
+      read_response.res.read.nbyte = pread(fd, read_buf, nbyte, offset);
+    data_len =
+        read_response.res.read.nbyte > 0 ? read_response.res.read.nbyte : 0;
+  }
+  read_response.header.errno_value = errno;
+  read_response.res.read.nholes = nholes;
+  if (read_response.res.read.nbyte >= 0 && pos >= 0 && fd >= 0 &&
+      fd < MAX_TRACKED_FD)
+    ra[fd].next = pos + read_response.res.read.nbyte;
+
+  unsigned char holes_wire[SPARSE_MAX_HOLES * WIRE_SIZE_read_hole];
+  unsigned char *p = holes_wire;
+  for (int i = 0; i < nholes; i++)
+    p = wire_read_hole_encode(p, &holes[i]);
+  if (session_features & FEAT_CRC32C)
+    sum = crc32c(sum, holes_wire, p - holes_wire);
+  unsigned char sum_wire[WIRE_CRC_SIZE];
+  wire_put_u32(sum_wire, sum);
+  struct iovec read_iov[] = {
+      {read_buf, data_len},
+      {holes_wire, p - holes_wire},
+      {sum_wire, session_features & FEAT_CRC32C ? WIRE_CRC_SIZE : 0},
+  };
+  // the data is in read_buf, so metadata requests need not wait for it to
+  // reach the client
+  session_leave();
+  send_response(sessfd, READ, &read_response, read_iov, 3);
+  free(read_buf);
+}
+
 void execute_request(request *req, int sessfd) {
+  struct change c = {0};
+  request_changes(req, &c);
+  lease_begin(&c);
   switch (req->header.opcode) {
   case OPEN:
-    int fd = open(req->req.open.pathname, req->req.open.flags, req->req.open.m);
+    int fd;
+    if (req->header.flags & REQ_OPEN_DELTA)
+      fd = open_for_delta(req->req.open.pathname, req->req.open.flags,
+                          req->req.open.m);
+    else if (cacheable_open(req->req.open.flags))
+      fd = open_cached(req->req.open.pathname, req->req.open.flags);
+    else
+      fd = open(req->req.open.pathname, req->req.open.flags, req->req.open.m);
     response open_res = {.header.errno_value = errno,
-                         .header.payload_len = sizeof(union res_union),
                          .res.open.ret_val = fd};
-    send(sessfd, (void *)&open_res, sizeof(response), 0);
+    readahead_reset(fd);
+    send_response(sessfd, OPEN, &open_res, NULL, 0);
     break;
   case READ:
-    response *read_response = malloc(MAXMSGLEN);
-    size_t nbyte = read(req->req.read.fildes, read_response->res.read.buf,
-                        req->req.read.nbyte);
-
-    read_response->header.errno_value = errno;
-    read_response->header.payload_len = sizeof(union res_union) + nbyte;
-    read_response->res.read.nbyte = nbyte;
-
-    send(sessfd, (void *)read_response, sizeof(response) + nbyte, 0);
-    free(read_response);
+    read_file(req->req.read.fildes, req->req.read.nbyte, -1, sessfd);
+    break;
+  case PREAD:
+    read_file(req->req.pread.fd, req->req.pread.nbyte, req->req.pread.offset,
+              sessfd);
     break;
   case WRITE:
-    ssize_t cnt =
-        write(req->req.write.fd, req->req.write.buf, req->req.write.count);
+    ssize_t cnt = -1;
+    if (bad_crc)
+      errno = EIO;
+    else
+      cnt = write(req->req.write.fd, req->req.write.buf, req->req.write.count);
     response write_res = {.header.errno_value = errno,
-                          .header.payload_len = sizeof(union res_union),
-                          .res.write.ret_val = cnt};
-    send(sessfd, (void *)&write_res, sizeof(response), 0);
+                           .res.write.ret_val = cnt};
+    send_response(sessfd, WRITE, &write_res, NULL, 0);
     break;
   case CLOSE:
-    int ret = close(req->req.close.fd);
+    drop_snapshot(req->req.close.fd);
+    int ret = close_cached(req->req.close.fd);
     response close_res = {.header.errno_value = errno,
-                          .header.payload_len = sizeof(union res_union),
-                          .res.close.ret_val = ret};
-    send(sessfd, (void *)&close_res, sizeof(response), 0);
+                           .res.close.ret_val = ret};
+    send_response(sessfd, CLOSE, &close_res, NULL, 0);
     break;
   case LSEEK:
     off_t off =
         lseek(req->req.lseek.fd, req->req.lseek.offset, req->req.lseek.whence);
     response lseek_response = {
         .header.errno_value = errno,
-        .header.payload_len = sizeof(union res_union),
-
         .res.lseek.off = off,
     };
-    send(sessfd, (void *)&lseek_response, sizeof(response), 0);
+    send_response(sessfd, LSEEK, &lseek_response, NULL, 0);
     break;
   case STAT:
     response stat_response;
     stat_response.res.stat.ret_val =
         stat(req->req.stat.pathname, &stat_response.res.stat.statbuf);
     stat_response.header.errno_value = errno;
-    stat_response.header.payload_len = sizeof(union res_union);
-    send(sessfd, (void *)&stat_response, sizeof(response), 0);
+    send_response(sessfd, STAT, &stat_response, NULL, 0);
     break;
   case UNLINK:
+    evict_handles(req->req.unlink.pathname);
     int ret_val = unlink(req->req.unlink.pathname);
     response unlink_response = {
         .header.errno_value = errno,
-        .header.payload_len = sizeof(union res_union),
-
         .res.unlink.ret_val = ret_val,
     };
-    send(sessfd, (void *)&unlink_response, sizeof(response), 0);
+    send_response(sessfd, UNLINK, &unlink_response, NULL, 0);
     break;
   case GETDIRENTRIES:
-    response *r = malloc(sizeof(response) + req->req.direntries.nbytes);
-    ssize_t bytes_read =
-        getdirentries(req->req.direntries.fd, r->res.direntries.buf,
-                      req->req.direntries.nbytes, &r->res.direntries.basep);
-
-    r->header.errno_value = errno;
-    r->header.payload_len = sizeof(union res_union) + bytes_read;
-    r->res.direntries.ret_val = bytes_read;
+    size_t nbytes = req->req.direntries.nbytes;
+    if (nbytes > MAXMSGLEN)
+      nbytes = MAXMSGLEN;
+    char *entries = malloc(nbytes);
+    response dir_response;
+    ssize_t bytes_read = getdirentries(req->req.direntries.fd, entries, nbytes,
+                                       &dir_response.res.direntries.basep);
+    dir_response.header.errno_value = errno;
+    size_t nrecs;
+    unsigned char *recs = malloc(bytes_read > 0 ? bytes_read : 0);
+    size_t recs_len =
+        encode_dirents(entries, bytes_read > 0 ? bytes_read : 0, recs, &nrecs);
+    dir_response.res.direntries.ret_val =
+        bytes_read < 0 ? -1 : (ssize_t)recs_len;
 
-    send(sessfd, (void *)r, sizeof(response) + bytes_read, 0);
-    free(r);
+    struct iovec dir_iov[] = {{recs, recs_len}};
+    session_leave();
+    send_response(sessfd, GETDIRENTRIES, &dir_response, dir_iov, 1);
+    free(entries);
+    free(recs);
     break;
   case GETDIRTREE:
     struct dirtreenode *root = getdirtree(req->req.dirtree.path);
     size_t tree_nbyte = 0;
-    char *buf = serialize_dirtree(root, &tree_nbyte);
-    response *dirtree_response = malloc(sizeof(response) + tree_nbyte);
-    dirtree_response->header.errno_value = errno;
-    dirtree_response->header.payload_len = sizeof(union res_union) + tree_nbyte;
-    memcpy(dirtree_response->res.dirtree.buf, buf, tree_nbyte);
+    // a missing directory is answered with no tree; sharded clients ask
+    // every server, and not all of them need to have it
+    response dirtree_response = {.header.errno_value = root ? 0 : errno};
+    char *buf = root ? serialize_dirtree(root, &tree_nbyte) : NULL;
+    struct iovec tree_iov[] = {{buf, tree_nbyte}};
+    session_leave();
+    send_response(sessfd, GETDIRTREE, &dirtree_response, tree_iov, 1);
     free(buf);
 
     recursive_free(root);
     root = NULL;
     freedirtree(root);
 
-    send(sessfd, (void *)dirtree_response, sizeof(response) + tree_nbyte, 0);
-    free(dirtree_response);
+    break;
+  case READDIRPLUS:
+    readdirplus(&req->req.direntries, sessfd);
+    break;
+  case CHECKSUMS:
+    checksums(&req->req.checksums, sessfd);
+    break;
+  case DELTA:
+    ssize_t delta_cnt = -1;
+    if (bad_crc)
+      errno = EIO;
+    else
+      delta_cnt = apply_delta(&req->req.delta, req->header.payload_len);
+    response delta_res = {.header.errno_value = errno,
+                           .res.write.ret_val = delta_cnt};
+    send_response(sessfd, DELTA, &delta_res, NULL, 0);
+    break;
+  case COPY:
+    copy_req *cr = &req->req.copy;
+    size_t paths_len = sizeof(req_header) + req->header.payload_len -
+                       offsetof(request, req.copy.paths);
+    response copy_response = {.res.copy.nbyte = -1};
+    if (cr->src_len == 0 || cr->src_len >= paths_len ||
+        cr->paths[cr->src_len - 1] != '\0')
+      copy_response.header.errno_value = EINVAL;
+    else {
+      copy_response.res.copy.nbyte =
+          copy_file(cr->paths, cr->paths + cr->src_len);
+      copy_response.header.errno_value = errno;
+    }
+    send_response(sessfd, COPY, &copy_response, NULL, 0);
+    break;
+  case OPTIONS:
+    uint32_t want = req->req.options.features;
+    session_features = want & (FEAT_CRC32C | FEAT_SPARSE);
+    sched_join(req->req.options.client);
+    response options_response = {.res.options.features = session_features};
+    if ((want & FEAT_META_CHANNEL) && !meta_channel) {
+      options_response.res.options.token = open_channel(meta_main);
+      if (options_response.res.options.token) {
+        options_response.res.options.features |= FEAT_META_CHANNEL;
+        meta_channel = 1;
+      }
+    }
+    if ((want & FEAT_LEASES) && !callback_channel) {
+      options_response.res.options.lease_token = open_channel(callback_main);
+      if (options_response.res.options.lease_token) {
+        options_response.res.options.features |= FEAT_LEASES;
+        callback_channel = 1;
+        __atomic_store_n(&leases->enabled, 1, __ATOMIC_RELEASE);
+      }
+    }
+    send_response(sessfd, OPTIONS, &options_response, NULL, 0);
+    break;
+  case ATTACH:
+    // on success the connection belongs to the other session from now on
+    if (attach_channel(sessfd, req->req.attach.token) == 0)
+      exit(0);
+    response attach_response = {.header.errno_value = ENOENT,
+                                .res.close.ret_val = -1};
+    send_response(sessfd, ATTACH, &attach_response, NULL, 0);
+    break;
+  case RMTREE:
+    ssize_t nremoved = rmtree(req->req.dirtree.path);
+    response rmtree_response = {.header.errno_value = errno,
+                                .res.rmtree.nremoved = nremoved};
+    send_response(sessfd, RMTREE, &rmtree_response, NULL, 0);
+    break;
+  case LEASE:
+    lease_path(&req->req.lease, sessfd);
     break;
   default:
     break;
   }
+  lease_end(&c);
+}
+
+// Serves the requests of one connection until it closes: the session's first
+// connection on the main thread, or its metadata channel, whose requests skip
+// the scheduler and go ahead of bulk ones.
+void serve(int sessfd, int meta) {
+  request *req = malloc(MAXMSGLEN + 1);
+  while (get_request(req, sessfd) == 0) {
+    size_t cost = meta ? 0 : request_cost(req);
+    if (cost > 0)
+      sched_admit(cost);
+    session_enter(meta);
+    execute_request(req, sessfd);
+    session_leave();
+    if (cost > 0)
+      sched_release(cost);
+    fprintf(stderr, "[server.c] Finish one request.\n");
+  }
+  fprintf(stderr, "[server.c] Connection close.\n");
+  free(req);
+  close(sessfd);
 }
 
 int main(int argc, char **argv) {
@@ -260,32 +2158,36 @@ int main(int argc, char **argv) {
   if (rv < 0)
     err(1, 0);
 
-  // main server loop, handle clients one at a time, quit after 10 clients
+  sched_init();
+  leases_init();
+
+  // main server loop, one session process per connection
   while (1) {
+    int slot = sched_reserve_slot();
 
     // wait for next client, get session socket
     sa_size = sizeof(struct sockaddr_in);
     sessfd = accept(sockfd, (struct sockaddr *)&cli, &sa_size);
     if (sessfd < 0)
       err(1, 0);
-    if (fork() == 0) {
+    pid_t pid = fork();
+    if (pid == 0) {
       // child
       close(sockfd);
-      while (1) {
-        request *req = malloc(MAXMSGLEN);
-        if (get_request(req, sessfd) != 0) {
-          fprintf(stderr, "[server.c] Connection close.\n");
-          free(req);
-          close(sessfd);
-          break;
-        }
-        execute_request(req, sessfd);
-        free(req);
-        fprintf(stderr, "[server.c] Finish one request.\n");
-      }
-      close(sessfd);
+      my_slot = slot;
+      serve(sessfd, 0);
+      session_enter(0);
+      lease_drop_slot(my_slot);
       exit(0);
     }
+    close(sessfd);
+    if (pid > 0) {
+      sched_lock();
+      sched->slots[slot].pid = pid;
+      pthread_mutex_unlock(&sched->lock);
+    } else {
+      sched_drop(-1);
+    }
   }
   close(sockfd);
 
@@ -0,0 +1,39 @@
+/**
+ * @file trace.h
+ * @brief Format of the call traces written by `mylib.so` and read by `replay`.
+ *
+ * With `trace15440` set, `mylib.so` writes one record per intercepted call
+ * that goes to a server into `<trace15440>.<pid>`. A trace file is
+ * TRACE_MAGIC followed by records, each TRACE_RECORD_SIZE bytes in the
+ * encoding of `wire.h` and then `path_len` bytes of path.
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+#include "wire.h"
+
+#define TRACE_MAGIC "440trc1\n"
+#define TRACE_MAGIC_LEN 8
+
+struct trace_record {
+  uint64_t start;    // CLOCK_MONOTONIC microseconds when the call was made
+  uint32_t duration; // microseconds the call took
+  uint8_t opcode;    // enum OPCODE of the call
+  uint8_t aux;       // whence for LSEEK
+  uint16_t path_len;
+  int32_t fd;  // fd the program passed, or -1
+  int64_t arg; // OPEN flags, READ/WRITE/GETDIRENTRIES byte count, LSEEK offset
+  int64_t ret; // what the call returned
+};
+
+#define TRACE_RECORD(F)                                                        \
+  F(u64, start)                                                                \
+  F(u32, duration)                                                             \
+  F(u8, opcode) F(u8, aux) F(u16, path_len) F(i32, fd) F(i64, arg) F(i64, ret)
+WIRE_CODEC(trace_record, struct trace_record, TRACE_RECORD)
+
+#define TRACE_RECORD_SIZE WIRE_SIZE_trace_record
+
+#endif
@@ -0,0 +1,536 @@
+/**
+ * @file wire.h
+ * @brief Wire encoding of requests and responses.
+ *
+ * `message.h` describes messages as host structs; this header defines how
+ * they travel. Every field has a fixed width and is stored little-endian, and
+ * each opcode only sends its own fields, so client and server don't need the
+ * same struct layouts. Open flags, `lseek()` whence values and errno values
+ * travel as the wire constants defined here rather than as host numbers.
+ * Variable-length parts (paths, file data, the serialized directory tree)
+ * follow the fixed fields as is; arrays of structs, including directory
+ * entries (`dirent_rec` plus the name), are encoded element by element.
+ *
+ * The fields of every message are listed once in the X-macro schemas below.
+ * `WIRE_CODEC()` generates the wire size, encoder and decoder of a message
+ * from its schema, and checks at compile time that no host field is wider
+ * than its wire field.
+ *
+ * Headers are 8 bytes:
+ * - request: version (u8), opcode (u8), flags (u16), payload length (u32)
+ * - response: errno value (i32, see wire_errnos), payload length (u32)
+ * where the payload length counts the bytes after the header.
+ *
+ * On connections that negotiated FEAT_CRC32C with OPTIONS, the file data of
+ * WRITE requests and READ/PREAD responses, and the ops and literals of DELTA
+ * requests, are followed by their CRC32C (u32).
+ * With FEAT_SPARSE, READ/PREAD data may be followed by a hole list instead of
+ * the zeros it describes; the CRC32C then covers the data and the list.
+ * With FEAT_LEASES, the server also writes RECALL responses, which answer no
+ * request, to the session's callback channel; RELEASEs sent there get none.
+ */
+#ifndef __WIRE_H__
+#define __WIRE_H__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "message.h"
+
+#define WIRE_VERSION 8
+#define WIRE_HEADER_SIZE 8
+#define WIRE_MAX_BODY 160 // largest fixed part of any message
+#define WIRE_CRC_SIZE 4
+
+static inline unsigned char *wire_put_u8(unsigned char *p, uint8_t v) {
+  p[0] = v;
+  return p + 1;
+}
+
+static inline unsigned char *wire_put_u16(unsigned char *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  return p + 2;
+}
+
+static inline unsigned char *wire_put_u32(unsigned char *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+  return p + 4;
+}
+
+static inline unsigned char *wire_put_u64(unsigned char *p, uint64_t v) {
+  p = wire_put_u32(p, (uint32_t)v);
+  return wire_put_u32(p, (uint32_t)(v >> 32));
+}
+
+static inline uint8_t wire_get_u8(const unsigned char *p) { return p[0]; }
+
+static inline uint16_t wire_get_u16(const unsigned char *p) {
+  return p[0] | p[1] << 8;
+}
+
+static inline uint32_t wire_get_u32(const unsigned char *p) {
+  return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t wire_get_u64(const unsigned char *p) {
+  return wire_get_u32(p) | (uint64_t)wire_get_u32(p + 4) << 32;
+}
+
+#define wire_put_i32(p, v) wire_put_u32(p, (uint32_t)(int32_t)(v))
+#define wire_put_i64(p, v) wire_put_u64(p, (uint64_t)(int64_t)(v))
+#define wire_get_i32(p) ((int32_t)wire_get_u32(p))
+#define wire_get_i64(p) ((int64_t)wire_get_u64(p))
+
+// A host constant and the wire constant it travels as.
+struct wire_const {
+  int host;
+  int wire;
+};
+
+// Open flags besides the access mode, which is sent as 0 (read), 1 (write)
+// or 2 (both). Flags without a wire constant are not sent. A flag made of
+// several bits, like O_SYNC, is only sent if all of them are set.
+static const struct wire_const wire_oflags[] = {
+    {O_CREAT, 1 << 2},     {O_EXCL, 1 << 3},      {O_NOCTTY, 1 << 4},
+    {O_TRUNC, 1 << 5},     {O_APPEND, 1 << 6},    {O_NONBLOCK, 1 << 7},
+    {O_DSYNC, 1 << 8},     {O_SYNC, 1 << 9},      {O_DIRECTORY, 1 << 10},
+    {O_NOFOLLOW, 1 << 11}, {O_CLOEXEC, 1 << 12},
+#ifdef O_DIRECT
+    {O_DIRECT, 1 << 13},
+#endif
+#ifdef O_NOATIME
+    {O_NOATIME, 1 << 14},
+#endif
+#ifdef O_PATH
+    {O_PATH, 1 << 15},
+#endif
+#ifdef O_TMPFILE
+    {O_TMPFILE, 1 << 16},
+#endif
+};
+
+static const struct wire_const wire_whences[] = {
+    {SEEK_SET, 0}, {SEEK_CUR, 1}, {SEEK_END, 2},
+#ifdef SEEK_DATA
+    {SEEK_DATA, 3}, {SEEK_HOLE, 4},
+#endif
+};
+
+// errno values, numbered as on Linux; others travel as EIO.
+static const struct wire_const wire_errnos[] = {
+    {EPERM, 1},         {ENOENT, 2},        {ESRCH, 3},
+    {EINTR, 4},         {EIO, 5},           {ENXIO, 6},
+    {E2BIG, 7},         {ENOEXEC, 8},       {EBADF, 9},
+    {ECHILD, 10},       {EAGAIN, 11},       {ENOMEM, 12},
+    {EACCES, 13},       {EFAULT, 14},       {EBUSY, 16},
+    {EEXIST, 17},       {EXDEV, 18},        {ENODEV, 19},
+    {ENOTDIR, 20},      {EISDIR, 21},       {EINVAL, 22},
+    {ENFILE, 23},       {EMFILE, 24},       {ENOTTY, 25},
+    {ETXTBSY, 26},      {EFBIG, 27},        {ENOSPC, 28},
+    {ESPIPE, 29},       {EROFS, 30},        {EMLINK, 31},
+    {EPIPE, 32},        {EDOM, 33},         {ERANGE, 34},
+    {EDEADLK, 35},      {ENAMETOOLONG, 36}, {ENOLCK, 37},
+    {ENOSYS, 38},       {ENOTEMPTY, 39},    {ELOOP, 40},
+    {ENODATA, 61},      {EOVERFLOW, 75},    {EOPNOTSUPP, 95},
+    {ECONNRESET, 104},  {ETIMEDOUT, 110},   {ESTALE, 116},
+    {EDQUOT, 122},
+};
+
+#define WIRE_NCONST(t) (sizeof(t) / sizeof(t[0]))
+
+// Looks `v` up in the `n` entries of `t`, as a host constant, or as a wire
+// constant with `to_host`, and returns its counterpart; `miss` if it is not
+// there.
+static inline int wire_map(const struct wire_const *t, size_t n, int v,
+                           int to_host, int miss) {
+  for (size_t i = 0; i < n; i++)
+    if ((to_host ? t[i].wire : t[i].host) == v)
+      return to_host ? t[i].host : t[i].wire;
+  return miss;
+}
+
+static inline unsigned char *wire_put_oflags(unsigned char *p, int flags) {
+  int acc = flags & O_ACCMODE;
+  uint32_t v = acc == O_WRONLY ? 1 : acc == O_RDWR ? 2 : 0;
+  for (size_t i = 0; i < WIRE_NCONST(wire_oflags); i++)
+    if ((flags & wire_oflags[i].host) == wire_oflags[i].host)
+      v |= wire_oflags[i].wire;
+  return wire_put_u32(p, v);
+}
+
+static inline int wire_get_oflags(const unsigned char *p) {
+  uint32_t v = wire_get_u32(p);
+  int flags = (v & 3) == 1 ? O_WRONLY : (v & 3) == 2 ? O_RDWR : O_RDONLY;
+  for (size_t i = 0; i < WIRE_NCONST(wire_oflags); i++)
+    if (v & wire_oflags[i].wire)
+      flags |= wire_oflags[i].host;
+  return flags;
+}
+
+// unknown whence values are sent as -1, which lseek() rejects
+static inline unsigned char *wire_put_whence(unsigned char *p, int whence) {
+  return wire_put_i32(
+      p, wire_map(wire_whences, WIRE_NCONST(wire_whences), whence, 0, -1));
+}
+
+static inline int wire_get_whence(const unsigned char *p) {
+  return wire_map(wire_whences, WIRE_NCONST(wire_whences), wire_get_i32(p), 1,
+                  -1);
+}
+
+static inline unsigned char *wire_put_errno(unsigned char *p, int e) {
+  if (e != 0)
+    e = wire_map(wire_errnos, WIRE_NCONST(wire_errnos), e, 0, 5);
+  return wire_put_i32(p, e);
+}
+
+static inline int wire_get_errno(const unsigned char *p) {
+  int e = wire_get_i32(p);
+  return e ? wire_map(wire_errnos, WIRE_NCONST(wire_errnos), e, 1, EIO) : 0;
+}
+
+#define WIRE_SIZE_u8 1
+#define WIRE_SIZE_u16 2
+#define WIRE_SIZE_i32 4
+#define WIRE_SIZE_u32 4
+#define WIRE_SIZE_i64 8
+#define WIRE_SIZE_u64 8
+#define WIRE_SIZE_oflags 4
+#define WIRE_SIZE_whence 4
+#define WIRE_FITS_u8(n) ((n) <= 1)
+#define WIRE_FITS_u16(n) ((n) <= 2)
+#define WIRE_FITS_i32(n) ((n) <= 4)
+#define WIRE_FITS_u32(n) ((n) <= 4)
+#define WIRE_FITS_i64(n) ((n) <= 8)
+#define WIRE_FITS_u64(n) ((n) <= 8)
+#define WIRE_FITS_oflags(n) ((n) == sizeof(int))
+#define WIRE_FITS_whence(n) ((n) == sizeof(int))
+#define WIRE_FITS_stat(n) ((n) == sizeof(struct stat))
+
+#define WIRE_FIELD_SIZE(t, f) +WIRE_SIZE_##t
+#define WIRE_PUT(t, f) p = wire_put_##t(p, m->f);
+#define WIRE_GET(t, f)                                                         \
+  m->f = wire_get_##t(p);                                                      \
+  p += WIRE_SIZE_##t;
+#define WIRE_CHECK(t, f)                                                       \
+  _Static_assert(WIRE_FITS_##t(sizeof(m->f)),                                  \
+                 "host field " #f " is wider than its wire field");
+
+// Defines WIRE_SIZE_<name>, wire_<name>_encode() and wire_<name>_decode() for
+// a `type` whose fixed fields are listed by FIELDS(F) as F(wire type, field).
+#define WIRE_CODEC(name, type, FIELDS)                                         \
+  enum { WIRE_SIZE_##name = 0 FIELDS(WIRE_FIELD_SIZE) };                       \
+  _Static_assert(WIRE_SIZE_##name <= WIRE_MAX_BODY,                            \
+                 #name " exceeds WIRE_MAX_BODY");                              \
+  static inline unsigned char *wire_##name##_encode(unsigned char *p,          \
+                                                    const type *m) {           \
+    FIELDS(WIRE_PUT)                                                           \
+    (void)m;                                                                   \
+    return p;                                                                  \
+  }                                                                            \
+  static inline const unsigned char *wire_##name##_decode(                     \
+      const unsigned char *p, type *m) {                                       \
+    FIELDS(WIRE_CHECK)                                                         \
+    FIELDS(WIRE_GET)                                                           \
+    (void)m;                                                                   \
+    return p;                                                                  \
+  }
+
+#define WIRE_NO_FIELDS(F)
+
+// struct stat, with nanosecond timestamps
+#define WIRE_STAT(F)                                                           \
+  F(u64, st_dev)                                                               \
+  F(u64, st_ino)                                                               \
+  F(u32, st_mode)                                                              \
+  F(u64, st_nlink)                                                             \
+  F(u32, st_uid)                                                               \
+  F(u32, st_gid)                                                               \
+  F(u64, st_rdev)                                                              \
+  F(i64, st_size)                                                              \
+  F(i64, st_blksize)                                                           \
+  F(i64, st_blocks)                                                            \
+  F(i64, st_atim.tv_sec)                                                       \
+  F(i64, st_atim.tv_nsec)                                                      \
+  F(i64, st_mtim.tv_sec)                                                       \
+  F(i64, st_mtim.tv_nsec)                                                      \
+  F(i64, st_ctim.tv_sec)                                                       \
+  F(i64, st_ctim.tv_nsec)
+WIRE_CODEC(stat, struct stat, WIRE_STAT)
+
+// lets schemas use `stat` as a field type
+static inline unsigned char *wire_put_stat(unsigned char *p, struct stat st) {
+  return wire_stat_encode(p, &st);
+}
+static inline struct stat wire_get_stat(const unsigned char *p) {
+  struct stat st = {0};
+  wire_stat_decode(p, &st);
+  return st;
+}
+
+// Request bodies
+#define WIRE_OPEN_REQ(F) F(oflags, open.flags) F(u32, open.m)
+#define WIRE_READ_REQ(F) F(i32, read.fildes) F(u64, read.nbyte)
+#define WIRE_PREAD_REQ(F)                                                      \
+  F(i32, pread.fd) F(u64, pread.nbyte) F(i64, pread.offset)
+#define WIRE_WRITE_REQ(F) F(i32, write.fd) F(u64, write.count)
+#define WIRE_CLOSE_REQ(F) F(i32, close.fd)
+#define WIRE_LSEEK_REQ(F)                                                      \
+  F(i32, lseek.fd) F(i64, lseek.offset) F(whence, lseek.whence)
+#define WIRE_DIRENTRIES_REQ(F) F(i32, direntries.fd) F(u64, direntries.nbytes)
+#define WIRE_CHECKSUMS_REQ(F)                                                  \
+  F(i32, checksums.fd) F(u64, checksums.len) F(u64, checksums.block_size)
+#define WIRE_DELTA_REQ(F)                                                      \
+  F(i32, delta.fd)                                                             \
+  F(u64, delta.nops) F(u64, delta.literal_len) F(u64, delta.block_size)
+#define WIRE_COPY_REQ(F) F(u64, copy.src_len)
+#define WIRE_OPTIONS_REQ(F) F(u32, options.features) F(u64, options.client)
+#define WIRE_ATTACH_REQ(F) F(u64, attach.token)
+#define WIRE_LEASE_REQ(F) F(u32, lease.mode)
+#define WIRE_RELEASE_REQ(F) F(u64, release.lease)
+
+WIRE_CODEC(open_req, union req_union, WIRE_OPEN_REQ)
+WIRE_CODEC(read_req, union req_union, WIRE_READ_REQ)
+WIRE_CODEC(pread_req, union req_union, WIRE_PREAD_REQ)
+WIRE_CODEC(write_req, union req_union, WIRE_WRITE_REQ)
+WIRE_CODEC(close_req, union req_union, WIRE_CLOSE_REQ)
+WIRE_CODEC(lseek_req, union req_union, WIRE_LSEEK_REQ)
+WIRE_CODEC(path_req, union req_union, WIRE_NO_FIELDS)
+WIRE_CODEC(direntries_req, union req_union, WIRE_DIRENTRIES_REQ)
+WIRE_CODEC(checksums_req, union req_union, WIRE_CHECKSUMS_REQ)
+WIRE_CODEC(delta_req, union req_union, WIRE_DELTA_REQ)
+WIRE_CODEC(copy_req, union req_union, WIRE_COPY_REQ)
+WIRE_CODEC(options_req, union req_union, WIRE_OPTIONS_REQ)
+WIRE_CODEC(attach_req, union req_union, WIRE_ATTACH_REQ)
+WIRE_CODEC(lease_req, union req_union, WIRE_LEASE_REQ)
+WIRE_CODEC(release_req, union req_union, WIRE_RELEASE_REQ)
+
+// Response bodies
+#define WIRE_OPEN_RES(F) F(i32, open.ret_val)
+#define WIRE_READ_RES(F) F(i64, read.nbyte) F(u32, read.nholes)
+#define WIRE_WRITE_RES(F) F(i64, write.ret_val)
+#define WIRE_CLOSE_RES(F) F(i32, close.ret_val)
+#define WIRE_LSEEK_RES(F) F(i64, lseek.off)
+#define WIRE_STAT_RES(F) F(i32, stat.ret_val) F(stat, stat.statbuf)
+#define WIRE_UNLINK_RES(F) F(i32, unlink.ret_val)
+#define WIRE_DIRENTRIES_RES(F)                                                 \
+  F(i64, direntries.ret_val) F(i64, direntries.basep)
+#define WIRE_READDIRPLUS_RES(F)                                                \
+  F(i64, readdirplus.ret_val)                                                  \
+  F(i64, readdirplus.basep) F(u64, readdirplus.nattrs)
+#define WIRE_CHECKSUMS_RES(F)                                                  \
+  F(i32, checksums.ret_val)                                                    \
+  F(i64, checksums.pos)                                                        \
+  F(i64, checksums.size) F(i64, checksums.start) F(u64, checksums.nblocks)
+#define WIRE_COPY_RES(F) F(i64, copy.nbyte)
+#define WIRE_RMTREE_RES(F) F(i64, rmtree.nremoved)
+#define WIRE_OPTIONS_RES(F)                                                    \
+  F(u32, options.features)                                                     \
+  F(u64, options.token) F(u64, options.lease_token)
+#define WIRE_LEASE_RES(F)                                                      \
+  F(i32, lease.ret_val)                                                        \
+  F(stat, lease.statbuf)                                                       \
+  F(u64, lease.lease) F(u32, lease.mode) F(u32, lease.term_ms)
+#define WIRE_RECALL_RES(F) F(u64, recall.lease)
+
+WIRE_CODEC(open_res, union res_union, WIRE_OPEN_RES)
+WIRE_CODEC(read_res, union res_union, WIRE_READ_RES)
+WIRE_CODEC(write_res, union res_union, WIRE_WRITE_RES)
+WIRE_CODEC(close_res, union res_union, WIRE_CLOSE_RES)
+WIRE_CODEC(lseek_res, union res_union, WIRE_LSEEK_RES)
+WIRE_CODEC(stat_res, union res_union, WIRE_STAT_RES)
+WIRE_CODEC(unlink_res, union res_union, WIRE_UNLINK_RES)
+WIRE_CODEC(direntries_res, union res_union, WIRE_DIRENTRIES_RES)
+WIRE_CODEC(readdirplus_res, union res_union, WIRE_READDIRPLUS_RES)
+WIRE_CODEC(checksums_res, union res_union, WIRE_CHECKSUMS_RES)
+WIRE_CODEC(dirtree_res, union res_union, WIRE_NO_FIELDS)
+WIRE_CODEC(copy_res, union res_union, WIRE_COPY_RES)
+WIRE_CODEC(rmtree_res, union res_union, WIRE_RMTREE_RES)
+WIRE_CODEC(options_res, union res_union, WIRE_OPTIONS_RES)
+WIRE_CODEC(lease_res, union res_union, WIRE_LEASE_RES)
+WIRE_CODEC(recall_res, union res_union, WIRE_RECALL_RES)
+
+// Array elements
+#define WIRE_BLOCK_SUM(F) F(u32, weak) F(u64, strong)
+#define WIRE_DELTA_OP(F) F(i64, src) F(u64, len) F(u64, strong)
+#define WIRE_ENTRY_ATTR(F) F(i32, ret_val) F(stat, statbuf)
+#define WIRE_READ_HOLE(F) F(u64, off) F(u64, len)
+#define WIRE_DIRENT_REC(F) F(u64, ino) F(u64, off) F(u8, type) F(u16, name_len)
+
+WIRE_CODEC(block_sum, block_sum, WIRE_BLOCK_SUM)
+WIRE_CODEC(delta_op, delta_op, WIRE_DELTA_OP)
+WIRE_CODEC(entry_attr, entry_attr, WIRE_ENTRY_ATTR)
+WIRE_CODEC(read_hole, read_hole, WIRE_READ_HOLE)
+WIRE_CODEC(dirent_rec, dirent_rec, WIRE_DIRENT_REC)
+
+// Request and response body codec of each opcode: X(opcode, request codec,
+// response codec).
+#define WIRE_OPCODES(X)                                                        \
+  X(OPEN, open_req, open_res)                                                  \
+  X(READ, read_req, read_res)                                                  \
+  X(WRITE, write_req, write_res)                                               \
+  X(CLOSE, close_req, close_res)                                               \
+  X(LSEEK, lseek_req, lseek_res)                                               \
+  X(STAT, path_req, stat_res)                                                  \
+  X(UNLINK, path_req, unlink_res)                                              \
+  X(GETDIRENTRIES, direntries_req, direntries_res)                             \
+  X(GETDIRTREE, path_req, dirtree_res)                                         \
+  X(CHECKSUMS, checksums_req, checksums_res)                                   \
+  X(DELTA, delta_req, write_res)                                               \
+  X(READDIRPLUS, direntries_req, readdirplus_res)                              \
+  X(PREAD, pread_req, read_res)                                                \
+  X(COPY, copy_req, copy_res)                                                  \
+  X(RMTREE, path_req, rmtree_res)                                              \
+  X(OPTIONS, options_req, options_res)                                         \
+  X(ATTACH, attach_req, close_res)                                             \
+  X(LEASE, lease_req, lease_res)                                               \
+  X(RECALL, path_req, recall_res)                                              \
+  X(RELEASE, release_req, close_res)
+
+#define WIRE_REQ_SIZE(op, req, res)                                            \
+  case op:                                                                     \
+    return WIRE_SIZE_##req;
+#define WIRE_RES_SIZE(op, req, res)                                            \
+  case op:                                                                     \
+    return WIRE_SIZE_##res;
+#define WIRE_REQ_ENCODE(op, req, res)                                          \
+  case op:                                                                     \
+    return wire_##req##_encode(p, m);
+#define WIRE_REQ_DECODE(op, req, res)                                          \
+  case op:                                                                     \
+    return wire_##req##_decode(p, m);
+#define WIRE_RES_ENCODE(op, req, res)                                          \
+  case op:                                                                     \
+    return wire_##res##_encode(p, m);
+#define WIRE_RES_DECODE(op, req, res)                                          \
+  case op:                                                                     \
+    return wire_##res##_decode(p, m);
+
+// Wire size of the fixed part of a request, -1 for an unknown opcode.
+static inline long wire_req_size(int opcode) {
+  switch (opcode) { WIRE_OPCODES(WIRE_REQ_SIZE) }
+  return -1;
+}
+
+// Wire size of the fixed part of a response, -1 for an unknown opcode.
+static inline long wire_res_size(int opcode) {
+  switch (opcode) { WIRE_OPCODES(WIRE_RES_SIZE) }
+  return -1;
+}
+
+static inline unsigned char *
+wire_req_encode(int opcode, unsigned char *p, const union req_union *m) {
+  switch (opcode) { WIRE_OPCODES(WIRE_REQ_ENCODE) }
+  return p;
+}
+
+static inline const unsigned char *
+wire_req_decode(int opcode, const unsigned char *p, union req_union *m) {
+  switch (opcode) { WIRE_OPCODES(WIRE_REQ_DECODE) }
+  return p;
+}
+
+static inline unsigned char *
+wire_res_encode(int opcode, unsigned char *p, const union res_union *m) {
+  switch (opcode) { WIRE_OPCODES(WIRE_RES_ENCODE) }
+  return p;
+}
+
+static inline const unsigned char *
+wire_res_decode(int opcode, const unsigned char *p, union res_union *m) {
+  switch (opcode) { WIRE_OPCODES(WIRE_RES_DECODE) }
+  return p;
+}
+
+// Offset in union req_union where the variable part of a request goes.
+static inline size_t wire_req_tail(int opcode) {
+  switch (opcode) {
+  case OPEN:
+    return offsetof(union req_union, open.pathname);
+  case STAT:
+    return offsetof(union req_union, stat.pathname);
+  case UNLINK:
+    return offsetof(union req_union, unlink.pathname);
+  case GETDIRTREE:
+  case RMTREE:
+    return offsetof(union req_union, dirtree.path);
+  case COPY:
+    return offsetof(union req_union, copy.paths);
+  case LEASE:
+    return offsetof(union req_union, lease.pathname);
+  case WRITE:
+    return offsetof(union req_union, write.buf);
+  case DELTA:
+    return offsetof(union req_union, delta.buf);
+  default:
+    return sizeof(union req_union);
+  }
+}
+
+// Offset in union res_union where the variable part of a response goes.
+static inline size_t wire_res_tail(int opcode) {
+  switch (opcode) {
+  case READ:
+  case PREAD:
+    return offsetof(union res_union, read.buf);
+  case GETDIRENTRIES:
+    return offsetof(union res_union, direntries.buf);
+  case READDIRPLUS:
+    return offsetof(union res_union, readdirplus.buf);
+  case GETDIRTREE:
+    return offsetof(union res_union, dirtree.buf);
+  case CHECKSUMS:
+    return offsetof(union res_union, checksums.sums);
+  default:
+    return sizeof(union res_union);
+  }
+}
+
+// Whether the variable part of a request or response of `opcode` ends with a
+// CRC32C on connections with FEAT_CRC32C.
+static inline int wire_req_crc(int opcode) {
+  return opcode == WRITE || opcode == DELTA;
+}
+static inline int wire_res_crc(int opcode) {
+  return opcode == READ || opcode == PREAD;
+}
+
+static inline unsigned char *wire_req_header_encode(unsigned char *p,
+                                                    const req_header *h) {
+  p[0] = WIRE_VERSION;
+  p[1] = h->opcode;
+  p[2] = h->flags;
+  p[3] = h->flags >> 8;
+  return wire_put_u32(p + 4, h->payload_len);
+}
+
+static inline void wire_req_header_decode(const unsigned char *p,
+                                          req_header *h) {
+  h->version = p[0];
+  h->opcode = p[1];
+  h->flags = p[2] | p[3] << 8;
+  h->payload_len = wire_get_u32(p + 4);
+}
+
+static inline unsigned char *wire_res_header_encode(unsigned char *p,
+                                                    const response_header *h) {
+  p = wire_put_errno(p, h->errno_value);
+  return wire_put_u32(p, h->payload_len);
+}
+
+static inline void wire_res_header_decode(const unsigned char *p,
+                                          response_header *h) {
+  h->errno_value = wire_get_errno(p);
+  h->payload_len = wire_get_u32(p + 4);
+}
+
+#endif